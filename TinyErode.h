@@ -20,395 +20,4073 @@
 
 #include <algorithm>
 #include <array>
-#include <numeric>
+#include <limits>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <cassert>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+/// When non-zero, the flow, water transport, erosion and advection kernels have
+/// versions for SSE2, AVX2 and AVX-512, and the widest one that the CPU
+/// supports is chosen at run time. They are written once, against the backends
+/// in the @c SIMD namespace, and the scalar code computes each cell with the
+/// same functions, so all of them give the same results. The vectorized
+/// versions are used with single precision scalars and storage. The flow and
+/// water transport kernels additionally require the default flow layout. The
+/// flow kernel also requires the height and water to
+/// be read through row pointers (see @ref HasRowAccess), the water transport
+/// kernel requires the water to be added to a @ref BasicTerrain, and the
+/// erosion kernel requires the carry capacity, deposition and erosion to be
+/// uniform (see @ref IsUniform). This is enabled by default when compiling for
+/// x86-64, and does not require compiling with any instruction set flags.
+#ifndef TINYERODE_SIMD
+#if defined(__x86_64__) || defined(_M_X64)
+#define TINYERODE_SIMD 1
+#else
+#define TINYERODE_SIMD 0
+#endif
+#endif
+
+#if TINYERODE_SIMD
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <immintrin.h>
+
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TINYERODE_TARGET(isa) __attribute__((target(isa)))
+#define TINYERODE_INLINE __attribute__((always_inline)) inline
+#elif defined(_MSC_VER)
+#define TINYERODE_TARGET(isa)
+#define TINYERODE_INLINE __forceinline
+#else
+#define TINYERODE_TARGET(isa)
+#define TINYERODE_INLINE inline
+#endif
+
+/// Keeps a product from being fused with the addition or subtraction it feeds
+/// into. GCC fuses them by default where the instruction set has fused
+/// multiply-add, which rounds differently, so without this the vectorized and
+/// scalar kernels could give different results. The empty assembly statement
+/// costs nothing, but the compiler can not see through it.
+#if defined(__GNUC__) && defined(__SSE2__)
+#define TINYERODE_UNFUSED(value) __asm__("" : "+x"(value))
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define TINYERODE_UNFUSED(value) __asm__("" : "+w"(value))
+#else
+#define TINYERODE_UNFUSED(value) (void)(value)
+#endif
 
 namespace TinyErode {
 
-/// Used for simulating a rainfall event on a terrain.
-/// Stores information on the terrain that is required to simulate the effect of
-/// hydraulic erosion.
+/// An allocator that aligns memory to at least @p Alignment bytes, which by
+/// default starts each grid of a simulation on a cache line. The rows of the
+/// grids are not aligned, since they are padded with a halo, so the vector
+/// kernels always use unaligned loads.
 ///
-/// @note The class should only be used once per rainfall event.
-class Simulation final
+/// Allocations that span at least one huge page are aligned to the huge page
+/// size and, on Linux, marked as candidates for transparent huge pages. On
+/// large terrains, this removes most of the TLB misses caused by walking the
+/// grids.
+template<typename T, std::size_t Alignment = 64>
+class AlignedAllocator
 {
 public:
-  Simulation(int w = 0, int h = 0);
+  using value_type = T;
 
-  void SetMinTilt(const float minTilt) noexcept { mMinTilt = minTilt; }
+  /// The size of a huge page on most systems that support them.
+  static constexpr std::size_t HugePageSize = 2 * 1024 * 1024;
 
-  void SetTimeStep(float timeStep) noexcept { mTimeStep = timeStep; }
+  template<typename U>
+  struct rebind
+  {
+    using other = AlignedAllocator<U, Alignment>;
+  };
 
-  float GetTimeStep() const noexcept { return mTimeStep; }
+  AlignedAllocator() noexcept = default;
 
-  int GetWidth() const noexcept { return mSize[0]; }
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept
+  {}
 
-  int GetHeight() const noexcept { return mSize[1]; }
+  T* allocate(std::size_t count);
 
-  /// Called at the beginning of each iteration.
-  /// This function will compute the flow rate of each cell, based on the level
-  /// of water and the elevation at each point in the height map.
-  ///
-  /// @param height The function taking an x and y coordinate and returning the
-  ///               height value at each point in the map.
-  ///
-  /// @param water The function taking an x and y coordinate and returning the
-  ///              water level at each point in the map. The water levels can be
-  ///              initialized to simulate rainfall or river streams.
-  template<typename Height, typename Water>
-  void ComputeFlowAndTilt(const Height& height, const Water& water);
+  void deallocate(T* ptr, std::size_t count) noexcept;
+};
 
-  /// This function is called after @ref Simulation::ComputeFlow in order to
-  /// determine where the water at each cell is going to be moving.
-  ///
-  /// @param waterAdder A function taking an x and y coordinate as well as a
-  ///                   water value to be added to a cell within the water
-  ///                   model.
-  template<typename WaterAdder>
-  void TransportWater(WaterAdder waterAdder);
+template<typename T, typename U, std::size_t Alignment>
+bool
+operator==(const AlignedAllocator<T, Alignment>&,
+           const AlignedAllocator<U, Alignment>&) noexcept
+{
+  return true;
+}
 
-  /// Erodes and deposites sediment, and then moves remaining sediment based on
-  /// the velocity of the water at each cell.
-  ///
-  /// @param kC A function taking an x and y coordinate and returning the
-  ///           carry capacity constant at that particular location.
+template<typename T, typename U, std::size_t Alignment>
+bool
+operator!=(const AlignedAllocator<T, Alignment>&,
+           const AlignedAllocator<U, Alignment>&) noexcept
+{
+  return false;
+}
+
+/// A 16-bit IEEE 754 floating point number, used for storing the grids of a
+/// simulation in half of the memory. Values are converted to and from single
+/// precision with round-to-nearest-even, and all arithmetic is done in single
+/// precision.
+class Half final
+{
+public:
+  Half() noexcept = default;
+
+  explicit Half(float value) noexcept
+    : mBits(FromFloat(value))
+  {}
+
+  operator float() const noexcept { return ToFloat(mBits); }
+
+private:
+  static std::uint16_t FromFloat(float value) noexcept;
+
+  static float ToFloat(std::uint16_t bits) noexcept;
+
+private:
+  std::uint16_t mBits = 0;
+};
+
+/// A 16-bit "brain" floating point number, which has the same range as a
+/// single precision number but only eight bits of precision. Converting to and
+/// from single precision is cheaper than with @ref Half.
+class BFloat16 final
+{
+public:
+  BFloat16() noexcept = default;
+
+  explicit BFloat16(float value) noexcept
+    : mBits(FromFloat(value))
+  {}
+
+  operator float() const noexcept
+  {
+    std::uint32_t bits = std::uint32_t(mBits) << 16;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+private:
+  static std::uint16_t FromFloat(float value) noexcept;
+
+private:
+  std::uint16_t mBits = 0;
+};
+
+/// A parameter of the simulation, such as the erosion constant, that has the
+/// same value at every cell. It can be passed anywhere a function of the cell
+/// coordinates is expected. Plain arithmetic values are accepted as well, and
+/// are treated the same way.
+template<typename T>
+class Uniform final
+{
+public:
+  constexpr explicit Uniform(T value) noexcept
+    : mValue(value)
+  {}
+
+  constexpr T operator()(int, int) const noexcept { return mValue; }
+
+  constexpr T GetValue() const noexcept { return mValue; }
+
+private:
+  T mValue;
+};
+
+/// Indicates whether a parameter is known at compile time to have the same
+/// value at every cell.
+template<typename Parameter>
+struct IsUniform : std::is_arithmetic<Parameter>
+{};
+
+template<typename T>
+struct IsUniform<Uniform<T>> : std::true_type
+{};
+
+/// Indicates whether an accessor of the height or water model, besides being
+/// callable with an x and y coordinate, has a member function @c row that
+/// takes a y coordinate and returns a pointer to the first cell of that row.
+/// The simulation then reads the cells of a row through that pointer, which
+/// lets the compiler see that they are contiguous.
+///
+/// @code
+/// struct HeightMap
+/// {
+///   const float* data;
+///   int w;
+///
+///   float operator()(int x, int y) const { return data[(y * w) + x]; }
+///
+///   const float* row(int y) const { return data + (y * w); }
+/// };
+/// @endcode
+template<typename Accessor, typename = void>
+struct HasRowAccess : std::false_type
+{};
+
+template<typename Accessor>
+struct HasRowAccess<
+  Accessor,
+  decltype((void)std::declval<const Accessor&>().row(0))>
+  : std::is_pointer<decltype(std::declval<const Accessor&>().row(0))>
+{};
+
+/// Reads the cells of an accessor in a row and the rows directly above and
+/// below it. Accessors without row access are called for each cell instead.
+template<typename Accessor, bool Rows = HasRowAccess<Accessor>::value>
+class RowWindow final
+{
+public:
+  RowWindow(const Accessor& accessor, int, int) noexcept
+    : mAccessor(accessor)
+  {}
+
+  auto operator()(int x, int y) const -> decltype(
+    std::declval<const Accessor&>()(x, y))
+  {
+    return mAccessor(x, y);
+  }
+
+private:
+  const Accessor& mAccessor;
+};
+
+template<typename Accessor>
+class RowWindow<Accessor, true> final
+{
+public:
+  using Row = decltype(std::declval<const Accessor&>().row(0));
+
+  /// @param centerY The row at the center of the window.
   ///
-  /// @param kD A function taking an x and y coordinate and returning the
-  ///           deposition constant at that particular location.
+  /// @param h The number of rows of the accessor. The rows outside of the
+  ///          accessor are not read.
+  RowWindow(const Accessor& accessor, int centerY, int h)
+    : mFirstY(centerY - 1)
+  {
+    for (int i = 0; i < 3; i++) {
+      const int y = mFirstY + i;
+      mRows[i] = ((y >= 0) && (y < h)) ? accessor.row(y) : nullptr;
+    }
+  }
+
+  auto operator()(int x, int y) const noexcept -> decltype(Row()[x])
+  {
+    return mRows[y - mFirstY][x];
+  }
+
+  /// Gets the pointer to one of the rows of the window.
+  Row GetRow(int y) const noexcept { return mRows[y - mFirstY]; }
+
+private:
+  int mFirstY;
+
+  std::array<Row, 3> mRows;
+};
+
+/// Indicates whether an accessor has row access (see @ref HasRowAccess) to
+/// single precision values, which the vectorized kernels can read.
+template<typename Accessor, bool Rows = HasRowAccess<Accessor>::value>
+struct HasFloatRowAccess : std::false_type
+{};
+
+template<typename Accessor>
+struct HasFloatRowAccess<Accessor, true>
+  : std::is_convertible<typename RowWindow<Accessor, true>::Row, const float*>
+{};
+
+/// Makes a window of three rows of @p accessor, centered on @p y.
+template<typename Accessor>
+RowWindow<Accessor>
+MakeRowWindow(const Accessor& accessor, int y, int h)
+{
+  return RowWindow<Accessor>(accessor, y, h);
+}
+
+/// A grid of values that is stored in memory one row after another. It either
+/// owns its values, or refers to memory that is owned by someone else, so that
+/// existing buffers can be used without copying them. It has row access (see
+/// @ref HasRowAccess), so the simulation reads it without any callbacks.
+template<typename T>
+class Grid final
+{
+public:
+  Grid() noexcept = default;
+
+  /// Makes a grid that owns its values, which are all set to @p value.
+  Grid(int w, int h, T value = T())
+    : mValues(std::size_t(w) * std::size_t(h), value)
+    , mData(mValues.data())
+    , mWidth(w)
+    , mHeight(h)
+    , mStride(w)
+  {}
+
+  /// Makes a grid that refers to external memory, which has to outlive it.
   ///
-  /// @param kE A function taking an x and y coordinate and returning the
-  ///           erosion constant at that particular location.
+  /// @param stride The number of values from the start of one row to the
+  ///               start of the next one. Zero means that the rows are
+  ///               packed, which makes it the same as @p w.
+  Grid(T* data, int w, int h, std::ptrdiff_t stride = 0) noexcept
+    : mData(data)
+    , mWidth(w)
+    , mHeight(h)
+    , mStride(stride ? stride : w)
+  {}
+
+  Grid(const Grid& other)
+    : mValues(other.mValues)
+    , mData(other.OwnsValues() ? mValues.data() : other.mData)
+    , mWidth(other.mWidth)
+    , mHeight(other.mHeight)
+    , mStride(other.mStride)
+  {}
+
+  /// Moving a vector keeps its buffer, so the data pointer stays valid.
+  Grid(Grid&&) noexcept = default;
+
+  Grid& operator=(const Grid& other)
+  {
+    if (this != &other)
+      *this = Grid(other);
+
+    return *this;
+  }
+
+  Grid& operator=(Grid&&) noexcept = default;
+
+  int GetWidth() const noexcept { return mWidth; }
+
+  int GetHeight() const noexcept { return mHeight; }
+
+  std::ptrdiff_t GetStride() const noexcept { return mStride; }
+
+  /// Indicates whether the values are owned by the grid, instead of referring
+  /// to external memory.
+  bool OwnsValues() const noexcept
+  {
+    return !mValues.empty() && (mData == mValues.data());
+  }
+
+  T* row(int y) noexcept { return mData + (y * mStride); }
+
+  const T* row(int y) const noexcept { return mData + (y * mStride); }
+
+  T& operator()(int x, int y) noexcept { return row(y)[x]; }
+
+  T operator()(int x, int y) const noexcept { return row(y)[x]; }
+
+private:
+  std::vector<T> mValues;
+
+  T* mData = nullptr;
+
+  int mWidth = 0;
+
+  int mHeight = 0;
+
+  std::ptrdiff_t mStride = 0;
+};
+
+/// The height and water level of each cell of a terrain, which a simulation
+/// can operate on directly, instead of through functions that read and change
+/// them. Both grids either belong to the terrain or refer to external buffers.
+///
+/// When the simulation changes the water level of a cell, it is kept from
+/// becoming negative.
+template<typename Scalar = float>
+class BasicTerrain final
+{
+public:
+  BasicTerrain() = default;
+
+  /// Makes a terrain that owns its grids. The height and water level of each
+  /// cell are initially zero.
+  BasicTerrain(int w, int h)
+    : mHeightMap(w, h)
+    , mWaterMap(w, h)
+  {}
+
+  /// Makes a terrain from two external buffers, without copying them.
   ///
-  /// @param heightAdder A function taking an x and y coordinate, as well as a
-  ///                    height delta, and adding the value to the height model.
+  /// @param heightStride The stride of the rows of @p height. See @ref
+  ///                     Grid::Grid.
   ///
-  /// @note For simple models, @p Kc @p Ke and @p Kd can both be single, uniform
-  ///       values.
-  template<typename CarryCapacity,
-           typename Deposition,
-           typename Erosion,
-           typename HeightAdder>
-  void TransportSediment(CarryCapacity kC,
-                         Deposition kD,
-                         Erosion kE,
-                         HeightAdder heightAdder);
+  /// @param waterStride The stride of the rows of @p water.
+  BasicTerrain(Scalar* height,
+               Scalar* water,
+               int w,
+               int h,
+               std::ptrdiff_t heightStride = 0,
+               std::ptrdiff_t waterStride = 0) noexcept
+    : mHeightMap(height, w, h, heightStride)
+    , mWaterMap(water, w, h, waterStride)
+  {}
+
+  BasicTerrain(Grid<Scalar> heightMap, Grid<Scalar> waterMap)
+    : mHeightMap(std::move(heightMap))
+    , mWaterMap(std::move(waterMap))
+  {
+    assert(mHeightMap.GetWidth() == mWaterMap.GetWidth());
+    assert(mHeightMap.GetHeight() == mWaterMap.GetHeight());
+  }
 
-  /// Evaporates water in the water model, based on evaporation constants.
+  int GetWidth() const noexcept { return mHeightMap.GetWidth(); }
+
+  int GetHeight() const noexcept { return mHeightMap.GetHeight(); }
+
+  Grid<Scalar>& GetHeightMap() noexcept { return mHeightMap; }
+
+  const Grid<Scalar>& GetHeightMap() const noexcept { return mHeightMap; }
+
+  Grid<Scalar>& GetWaterMap() noexcept { return mWaterMap; }
+
+  const Grid<Scalar>& GetWaterMap() const noexcept { return mWaterMap; }
+
+  void AddHeight(int x, int y, Scalar heightDelta) noexcept
+  {
+    mHeightMap(x, y) += heightDelta;
+  }
+
+  Scalar AddWater(int x, int y, Scalar waterDelta) noexcept
+  {
+    Scalar& level = mWaterMap(x, y);
+    level = std::max(Scalar(0), level + waterDelta);
+    return level;
+  }
+
+private:
+  Grid<Scalar> mHeightMap;
+
+  Grid<Scalar> mWaterMap;
+};
+
+using Terrain = BasicTerrain<>;
+
+/// The models of the flow of water between cells. See @ref
+/// DynamicConfig::Model.
+enum class FlowModel
+{
+  /// Keeps an outflow for each of the four directions of a cell, and scales
+  /// them down together when they would drain more water than the cell has.
+  /// This is the model of the original paper.
+  Outflow,
+  /// Keeps a single signed flux for each pipe, on a staggered grid. One plane
+  /// holds the flux between each cell and its neighbor in the positive X
+  /// direction and the other holds the flux to the neighbor in the positive Y
+  /// direction. This halves the size of the flow field.
   ///
-  /// @param waterAdder A function taking an x and y coordiante as well as a
-  ///                   water value to be added to a cell within the water
-  ///                   model.
+  /// @warning This is a different flow model, so the terrain it erodes differs
+  ///          noticeably from the outflow model, and the two can not be
+  ///          compared cell by cell. A pipe only carries the net flux between
+  ///          its two cells, while the outflow model keeps an outflow for each
+  ///          direction. While the water turns around, both of those are
+  ///          nonzero and both respond to the difference in water level. The
+  ///          flux is also limited to a quarter of the water of a cell per
+  ///          pipe, since rescaling all four pipes of a cell would need every
+  ///          pipe of its neighbors first, and with that another pass and
+  ///          another grid. Only use it where the memory matters more than
+  ///          matching the outflow model.
   ///
-  /// @param kEvap A function taking an x and y coordinate and returning the
-  ///              evaporation constant at that particular location. It is
-  ///              the responsibility of this function to ensure that the water
-  ///              level does not become negative at this step.
-  template<typename WaterAdder, typename Evaporation>
-  void Evaporate(WaterAdder water, Evaporation kEvap);
+  /// @note The flow and water transport of this model deliberately stay
+  ///       scalar. The kernels in the @c SIMD namespace compute an outflow for
+  ///       each direction and rescale them together, which this model does not
+  ///       have, and the model is meant to save memory rather than time.
+  NetFlux
+};
 
-  /// Deposites all currently suspended sediment into the terrain.
-  template<typename HeightAdder>
-  void TerminateRainfall(HeightAdder heightAdder);
+/// The ways in which the outflows of @ref FlowModel::Outflow can be laid out in
+/// memory. See @ref DynamicConfig::Layout.
+enum class FlowLayout
+{
+  /// Stores the four outflows of each cell next to each other, as an array of
+  /// structures.
+  AOS,
+  /// Stores the outflows of each direction in a separate plane, as a structure
+  /// of arrays. This lets kernels that only read one direction of a
+  /// neighboring cell (such as the inflow computation) stream contiguous
+  /// memory.
+  SOA
+};
 
-  void Resize(int w, int h);
+/// The default configuration of a simulation, in which the minimum tilt and the
+/// size of the cells are set at run time. A configuration that fixes some of
+/// them at compile time derives from this and hides the members it changes.
+/// The compiler can then fold them into the kernels, which is worthwhile when
+/// the same configuration is used for many terrains.
+///
+/// @code
+/// struct SquareMeterCells : TinyErode::DynamicConfig
+/// {
+///   static constexpr bool FixedCellSize = true;
+///
+///   static constexpr double MetersPerX() { return 1; }
+///
+///   static constexpr double MetersPerY() { return 1; }
+/// };
+///
+/// TinyErode::BasicSimulation<float,
+///                            float,
+///                            std::allocator<float>,
+///                            SquareMeterCells> simulation(w, h);
+/// @endcode
+///
+/// A fixed value gives the same results as setting the same value at run time.
+struct DynamicConfig
+{
+  /// The acceleration due to gravity, in meters per second squared.
+  static constexpr double Gravity() { return 9.8; }
+
+  /// The cross sectional area of the virtual pipes between cells.
+  static constexpr double PipeArea() { return 1; }
+
+  /// Whether @ref DynamicConfig::MinTilt is used instead of the value passed
+  /// to @ref BasicSimulation::SetMinTilt.
+  static constexpr bool FixedMinTilt = false;
+
+  static constexpr double MinTilt() { return 0.01; }
+
+  /// Whether @ref DynamicConfig::MetersPerX and @ref DynamicConfig::MetersPerY
+  /// are used instead of the values passed to @ref
+  /// BasicSimulation::SetMetersPerX and @ref BasicSimulation::SetMetersPerY.
+  static constexpr bool FixedCellSize = false;
+
+  static constexpr double MetersPerX() { return 1; }
+
+  static constexpr double MetersPerY() { return 1; }
+
+  /// How the flow of water between cells is modeled. Unlike the other
+  /// settings, this changes the results.
+  static constexpr FlowModel Model = FlowModel::Outflow;
+
+  /// How the outflows are laid out in memory. Both layouts produce identical
+  /// results, so choosing between them only has an effect on performance. The
+  /// flow is only computed with the vectorized kernels in the SOA layout. This
+  /// has no effect on @ref FlowModel::NetFlux, which always stores its two
+  /// planes one after another.
+  static constexpr FlowLayout Layout = FlowLayout::SOA;
+
+  /// Whether the tilt of each cell is recomputed from the height map while
+  /// sediment is transported, instead of being stored by @ref
+  /// BasicSimulation::ComputeFlowAndTilt. This saves a whole grid of memory,
+  /// at the cost of reading the height map a second time in each iteration.
+  /// The height map then has to be passed to @ref
+  /// BasicSimulation::TransportSediment. The results are the same either way.
+  static constexpr bool RecomputeTilt = false;
+};
+
+/// The instruction sets that the vectorized kernels can be compiled for. See
+/// @ref TINYERODE_SIMD.
+enum class InstructionSet
+{
+  Scalar,
+  SSE2,
+  AVX2,
+  AVX512
+};
+
+/// Gets the widest instruction set that is supported by both the CPU and the
+/// build. The CPU is only queried once.
+inline InstructionSet
+GetSupportedInstructionSet() noexcept
+{
+  static const InstructionSet supported = []() {
+#if TINYERODE_SIMD && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+      return InstructionSet::AVX512;
+
+    if (__builtin_cpu_supports("avx2"))
+      return InstructionSet::AVX2;
+#elif TINYERODE_SIMD && defined(_MSC_VER)
+    int info[4];
+
+    __cpuid(info, 0);
+
+    const int leafCount = info[0];
+
+    __cpuid(info, 1);
+
+    const bool osSavesState = (info[2] & (1 << 27)) != 0;
+
+    if (osSavesState && (leafCount >= 7)) {
+
+      const unsigned long long enabledState = _xgetbv(0);
+
+      __cpuidex(info, 7, 0);
+
+      // The vector registers (and, for AVX-512, the mask registers) have to
+      // be saved by the operating system as well.
+      if ((info[1] & (1 << 16)) && ((enabledState & 0xe6) == 0xe6))
+        return InstructionSet::AVX512;
+
+      if ((info[1] & (1 << 5)) && ((enabledState & 0x6) == 0x6))
+        return InstructionSet::AVX2;
+    }
+#endif
+    return TINYERODE_SIMD ? InstructionSet::SSE2 : InstructionSet::Scalar;
+  }();
+
+  return supported;
+}
+
+#if TINYERODE_SIMD
+
+/// The inputs and outputs of the vectorized flow kernels, for the interior
+/// cells of one row. The pointers are to the first cell of the row, and the
+/// parameters are those of @ref BasicSimulation.
+struct FlowRow final
+{
+  /// The rows above, at and below the row being computed.
+  std::array<const float*, 3> height;
+
+  std::array<const float*, 3> water;
+
+  /// The planes of the flow field, in the order -Y, -X, +X and +Y.
+  std::array<float*, 4> flow;
+
+  /// Where the tilt is stored. Null if it is not computed.
+  float* tilt;
+
+  float timeStep;
+
+  float pipeArea;
+
+  float gravity;
+
+  std::array<float, 2> pipeLengths;
+};
+
+/// The inputs and outputs of the vectorized advection kernels, for one row.
+struct AdvectionRow final
+{
+  /// The sediment of the cell at the origin of the grid, which the samples are
+  /// offset from.
+  const float* sediment;
+
+  /// The velocity of the first cell of the row, with the X and Y components of
+  /// each cell next to each other.
+  const float* velocity;
+
+  /// Where the advected sediment of the first cell of the row is stored.
+  float* nextSediment;
+
+  int y;
+
+  /// The distance between two rows of the sediment grid.
+  int stride;
+
+  /// The range that the coordinates of the first sample are clamped to, so
+  /// that samples outside of the grid only read from the halo.
+  std::array<int, 2> minSample;
+
+  std::array<int, 2> maxSample;
+
+  float timeStep;
+
+  std::array<float, 2> pipeLengths;
+};
+
+/// The inputs and outputs of the vectorized water transport kernels, for one
+/// row of a terrain.
+struct WaterRow final
+{
+  /// The planes of the flow field at the first cell of the row, in the order
+  /// -Y, -X, +X and +Y.
+  std::array<const float*, 4> flow;
+
+  /// The distance between two rows of the flow field.
+  int stride;
+
+  /// The water level of the first cell of the row, which the transported water
+  /// is added to. Like @ref BasicTerrain::AddWater, it is kept from becoming
+  /// negative.
+  float* water;
+
+  /// Where the velocity of the first cell is stored, with the X and Y
+  /// components of each cell next to each other.
+  float* velocity;
+
+  float timeStep;
+
+  /// Added to the water level along with the transported water, but not used
+  /// for computing the velocity.
+  float evaporation;
+
+  std::array<float, 2> pipeLengths;
+};
+
+/// The inputs and outputs of the vectorized erosion kernels, for a run of
+/// cells in one row. The parameters are the same at every cell.
+struct ErosionRow final
+{
+  /// The tilt of the first cell.
+  const float* tilt;
+
+  /// The velocity of the first cell, with the X and Y components of each cell
+  /// next to each other.
+  const float* velocity;
+
+  /// The sediment of the first cell, which is eroded or deposited in place.
+  float* sediment;
+
+  /// Where the change in height of the first cell is stored. The changes are
+  /// passed on to the height model once the kernel is done.
+  float* heightDelta;
+
+  float carryCapacity;
+
+  float deposition;
+
+  float erosion;
+
+  float minTilt;
+};
+
+#endif
+
+// Some versions of GCC warn about the undefined inputs of the AVX-512
+// intrinsics, and about vectors that the kernels pass by value, which never
+// happens once they are inlined into a function compiled for their instruction
+// set.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+/// A thin layer over the vector instructions of each instruction set, so that
+/// the kernels are only written once. Every backend has the same members: the
+/// type of the values, the types of a vector of them, of integers and of a mask
+/// with a lane per value, the number of lanes, and functions that work lane by
+/// lane.
+///
+/// Comparisons are false for NaN, and like the instructions they map to, @c
+/// Min and @c Max return their second operand when either operand is NaN. The
+/// products of @c Mul are not fused with other operations (see @ref
+/// SIMD::Serial for the exception). Each function of the vector backends is
+/// compiled for the instruction set of its backend, so the kernels must be
+/// inlined into a function that is compiled for it as well. See @ref
+/// RunKernel.
+namespace SIMD {
+
+/// Works on one value at a time. This is what the scalar members of @ref
+/// BasicSimulation compute with, in any precision, and what the vectorized
+/// kernels use for the cells that are left over at the end of a row.
+///
+/// @tparam T The type of the values, which is float or double.
+///
+/// @tparam Unfused Whether the products of @c Mul are kept from being fused.
+///                 This is only needed where the results have to match the
+///                 vector backends, and otherwise lets the compiler use fused
+///                 multiply-add.
+template<typename T, bool Unfused = true>
+struct Serial final
+{
+  using Value = T;
+
+  using Float = T;
+
+  using Int = int;
+
+  using Mask = bool;
+
+  static constexpr int Lanes = 1;
+
+  static Float Set(Value value) noexcept { return value; }
+
+  static Int Set(int value) noexcept { return value; }
+
+  /// Gets the integers from @p first up, one per lane.
+  static Int Iota(int first) noexcept { return first; }
+
+  static Float Load(const Value* values) noexcept { return *values; }
+
+  static void Store(Value* values, Float v) noexcept { *values = v; }
+
+  /// Loads vectors of X and Y components, which are stored next to each other.
+  static void LoadPairs(const Value* values, Float& x, Float& y) noexcept
+  {
+    x = values[0];
+    y = values[1];
+  }
+
+  static void StorePairs(Value* values, Float x, Float y) noexcept
+  {
+    values[0] = x;
+    values[1] = y;
+  }
+
+  static Float Gather(const Value* values, Int index) noexcept
+  {
+    return values[index];
+  }
+
+  static Float Add(Float a, Float b) noexcept { return a + b; }
+
+  static Float Sub(Float a, Float b) noexcept { return a - b; }
+
+  static Float Mul(Float a, Float b) noexcept
+  {
+    Float product = a * b;
+    if (Unfused)
+      TINYERODE_UNFUSED(product);
+    return product;
+  }
+
+  static Float Div(Float a, Float b) noexcept { return a / b; }
+
+  static Float Min(Float a, Float b) noexcept { return (a < b) ? a : b; }
+
+  static Float Max(Float a, Float b) noexcept { return (a > b) ? a : b; }
+
+  static Float Sqrt(Float a) noexcept { return std::sqrt(a); }
+
+  static Float Abs(Float a) noexcept { return std::abs(a); }
+
+  static Float Neg(Float a) noexcept { return -a; }
+
+  static Mask Equal(Float a, Float b) noexcept { return a == b; }
+
+  static Mask Greater(Float a, Float b) noexcept { return a > b; }
+
+  /// Indicates whether every lane of @p mask is set.
+  static bool All(Mask mask) noexcept { return mask; }
+
+  /// Picks the lanes of @p a where @p mask is set, and those of @p b elsewhere.
+  static Float Select(Mask mask, Float a, Float b) noexcept
+  {
+    return mask ? a : b;
+  }
+
+  static Int Add(Int a, Int b) noexcept { return a + b; }
+
+  static Int Sub(Int a, Int b) noexcept { return a - b; }
+
+  static Int Mul(Int a, Int b) noexcept { return a * b; }
+
+  static Int Min(Int a, Int b) noexcept { return std::min(a, b); }
+
+  static Int Max(Int a, Int b) noexcept { return std::max(a, b); }
+
+  /// Converts to integers, rounding towards zero.
+  static Int Truncate(Float a) noexcept { return Int(a); }
+
+  static Float ToFloat(Int a) noexcept { return Float(a); }
+};
+
+#if TINYERODE_SIMD
+
+/// Works on four values at a time. SSE2 is part of every x86-64 processor, so
+/// this backend is always available. The instructions it lacks are emulated.
+struct SSE2 final
+{
+  using Value = float;
+
+  using Float = __m128;
+
+  using Int = __m128i;
+
+  using Mask = __m128;
+
+  static constexpr int Lanes = 4;
+
+  TINYERODE_TARGET("sse2")
+  static Float Set(float value) noexcept { return _mm_set1_ps(value); }
+
+  TINYERODE_TARGET("sse2")
+  static Int Set(int value) noexcept { return _mm_set1_epi32(value); }
+
+  TINYERODE_TARGET("sse2")
+  static Int Iota(int first) noexcept
+  {
+    return _mm_add_epi32(_mm_set1_epi32(first), _mm_setr_epi32(0, 1, 2, 3));
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Float Load(const float* values) noexcept
+  {
+    return _mm_loadu_ps(values);
+  }
+
+  TINYERODE_TARGET("sse2")
+  static void Store(float* values, Float v) noexcept
+  {
+    _mm_storeu_ps(values, v);
+  }
+
+  TINYERODE_TARGET("sse2")
+  static void LoadPairs(const float* values, Float& x, Float& y) noexcept
+  {
+    const __m128 a = _mm_loadu_ps(values);
+    const __m128 b = _mm_loadu_ps(values + 4);
+
+    x = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    y = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+  }
+
+  TINYERODE_TARGET("sse2")
+  static void StorePairs(float* values, Float x, Float y) noexcept
+  {
+    _mm_storeu_ps(values, _mm_unpacklo_ps(x, y));
+    _mm_storeu_ps(values + 4, _mm_unpackhi_ps(x, y));
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Float Gather(const float* values, Int index) noexcept
+  {
+    alignas(16) int indices[4];
+
+    _mm_store_si128(reinterpret_cast<__m128i*>(indices), index);
+
+    return _mm_setr_ps(values[indices[0]],
+                       values[indices[1]],
+                       values[indices[2]],
+                       values[indices[3]]);
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Float Add(Float a, Float b) noexcept { return _mm_add_ps(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static Float Sub(Float a, Float b) noexcept { return _mm_sub_ps(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static Float Mul(Float a, Float b) noexcept
+  {
+    Float product = _mm_mul_ps(a, b);
+    TINYERODE_UNFUSED(product);
+    return product;
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Float Div(Float a, Float b) noexcept { return _mm_div_ps(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static Float Min(Float a, Float b) noexcept { return _mm_min_ps(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static Float Max(Float a, Float b) noexcept { return _mm_max_ps(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static Float Sqrt(Float a) noexcept { return _mm_sqrt_ps(a); }
+
+  TINYERODE_TARGET("sse2")
+  static Float Abs(Float a) noexcept
+  {
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Float Neg(Float a) noexcept
+  {
+    return _mm_xor_ps(_mm_set1_ps(-0.0f), a);
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Mask Equal(Float a, Float b) noexcept { return _mm_cmpeq_ps(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static Mask Greater(Float a, Float b) noexcept { return _mm_cmpgt_ps(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static bool All(Mask mask) noexcept { return _mm_movemask_ps(mask) == 0xf; }
+
+  TINYERODE_TARGET("sse2")
+  static Float Select(Mask mask, Float a, Float b) noexcept
+  {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Int Add(Int a, Int b) noexcept { return _mm_add_epi32(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static Int Sub(Int a, Int b) noexcept { return _mm_sub_epi32(a, b); }
+
+  TINYERODE_TARGET("sse2")
+  static Int Mul(Int a, Int b) noexcept
+  {
+    // The low half of an unsigned product is the same as that of a signed
+    // one, so the even and odd lanes are multiplied separately.
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd =
+      _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Int Min(Int a, Int b) noexcept
+  {
+    const __m128i greater = _mm_cmpgt_epi32(a, b);
+
+    return _mm_or_si128(_mm_and_si128(greater, b),
+                        _mm_andnot_si128(greater, a));
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Int Max(Int a, Int b) noexcept
+  {
+    const __m128i greater = _mm_cmpgt_epi32(a, b);
+
+    return _mm_or_si128(_mm_and_si128(greater, a),
+                        _mm_andnot_si128(greater, b));
+  }
+
+  TINYERODE_TARGET("sse2")
+  static Int Truncate(Float a) noexcept { return _mm_cvttps_epi32(a); }
+
+  TINYERODE_TARGET("sse2")
+  static Float ToFloat(Int a) noexcept { return _mm_cvtepi32_ps(a); }
+};
+
+/// Works on eight values at a time.
+struct AVX2 final
+{
+  using Value = float;
+
+  using Float = __m256;
+
+  using Int = __m256i;
+
+  using Mask = __m256;
+
+  static constexpr int Lanes = 8;
+
+  TINYERODE_TARGET("avx2")
+  static Float Set(float value) noexcept { return _mm256_set1_ps(value); }
+
+  TINYERODE_TARGET("avx2")
+  static Int Set(int value) noexcept { return _mm256_set1_epi32(value); }
+
+  TINYERODE_TARGET("avx2")
+  static Int Iota(int first) noexcept
+  {
+    return _mm256_add_epi32(_mm256_set1_epi32(first),
+                            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Float Load(const float* values) noexcept
+  {
+    return _mm256_loadu_ps(values);
+  }
+
+  TINYERODE_TARGET("avx2")
+  static void Store(float* values, Float v) noexcept
+  {
+    _mm256_storeu_ps(values, v);
+  }
+
+  TINYERODE_TARGET("avx2")
+  static void LoadPairs(const float* values, Float& x, Float& y) noexcept
+  {
+    // The shuffles leave the components in the order 0, 1, 4, 5, 2, 3, 6 and
+    // 7, which the permutations then sort.
+    const __m256 a = _mm256_loadu_ps(values);
+    const __m256 b = _mm256_loadu_ps(values + 8);
+
+    x = _mm256_castpd_ps(_mm256_permute4x64_pd(
+      _mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+      _MM_SHUFFLE(3, 1, 2, 0)));
+
+    y = _mm256_castpd_ps(_mm256_permute4x64_pd(
+      _mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))),
+      _MM_SHUFFLE(3, 1, 2, 0)));
+  }
+
+  TINYERODE_TARGET("avx2")
+  static void StorePairs(float* values, Float x, Float y) noexcept
+  {
+    const __m256 low = _mm256_unpacklo_ps(x, y);
+    const __m256 high = _mm256_unpackhi_ps(x, y);
+
+    _mm256_storeu_ps(values, _mm256_permute2f128_ps(low, high, 0x20));
+    _mm256_storeu_ps(values + 8, _mm256_permute2f128_ps(low, high, 0x31));
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Float Gather(const float* values, Int index) noexcept
+  {
+    return _mm256_i32gather_ps(values, index, 4);
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Float Add(Float a, Float b) noexcept { return _mm256_add_ps(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Float Sub(Float a, Float b) noexcept { return _mm256_sub_ps(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Float Mul(Float a, Float b) noexcept
+  {
+    Float product = _mm256_mul_ps(a, b);
+    TINYERODE_UNFUSED(product);
+    return product;
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Float Div(Float a, Float b) noexcept { return _mm256_div_ps(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Float Min(Float a, Float b) noexcept { return _mm256_min_ps(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Float Max(Float a, Float b) noexcept { return _mm256_max_ps(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Float Sqrt(Float a) noexcept { return _mm256_sqrt_ps(a); }
+
+  TINYERODE_TARGET("avx2")
+  static Float Abs(Float a) noexcept
+  {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Float Neg(Float a) noexcept
+  {
+    return _mm256_xor_ps(_mm256_set1_ps(-0.0f), a);
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Mask Equal(Float a, Float b) noexcept
+  {
+    return _mm256_cmp_ps(a, b, _CMP_EQ_OQ);
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Mask Greater(Float a, Float b) noexcept
+  {
+    return _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+  }
+
+  TINYERODE_TARGET("avx2")
+  static bool All(Mask mask) noexcept
+  {
+    return _mm256_movemask_ps(mask) == 0xff;
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Float Select(Mask mask, Float a, Float b) noexcept
+  {
+    return _mm256_blendv_ps(b, a, mask);
+  }
+
+  TINYERODE_TARGET("avx2")
+  static Int Add(Int a, Int b) noexcept { return _mm256_add_epi32(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Int Sub(Int a, Int b) noexcept { return _mm256_sub_epi32(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Int Mul(Int a, Int b) noexcept { return _mm256_mullo_epi32(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Int Min(Int a, Int b) noexcept { return _mm256_min_epi32(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Int Max(Int a, Int b) noexcept { return _mm256_max_epi32(a, b); }
+
+  TINYERODE_TARGET("avx2")
+  static Int Truncate(Float a) noexcept { return _mm256_cvttps_epi32(a); }
+
+  TINYERODE_TARGET("avx2")
+  static Float ToFloat(Int a) noexcept { return _mm256_cvtepi32_ps(a); }
+};
+
+/// Works on sixteen values at a time.
+struct AVX512 final
+{
+  using Value = float;
+
+  using Float = __m512;
+
+  using Int = __m512i;
+
+  using Mask = __mmask16;
+
+  static constexpr int Lanes = 16;
+
+  TINYERODE_TARGET("avx512f")
+  static Float Set(float value) noexcept { return _mm512_set1_ps(value); }
+
+  TINYERODE_TARGET("avx512f")
+  static Int Set(int value) noexcept { return _mm512_set1_epi32(value); }
+
+  TINYERODE_TARGET("avx512f")
+  static Int Iota(int first) noexcept
+  {
+    return _mm512_add_epi32(
+      _mm512_set1_epi32(first),
+      _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Load(const float* values) noexcept
+  {
+    return _mm512_loadu_ps(values);
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static void Store(float* values, Float v) noexcept
+  {
+    _mm512_storeu_ps(values, v);
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static void LoadPairs(const float* values, Float& x, Float& y) noexcept
+  {
+    const __m512 a = _mm512_loadu_ps(values);
+    const __m512 b = _mm512_loadu_ps(values + 16);
+
+    const __m512i even = _mm512_setr_epi32(
+      0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i odd = _mm512_setr_epi32(
+      1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+
+    x = _mm512_permutex2var_ps(a, even, b);
+    y = _mm512_permutex2var_ps(a, odd, b);
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static void StorePairs(float* values, Float x, Float y) noexcept
+  {
+    const __m512i low = _mm512_setr_epi32(
+      0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+    const __m512i high = _mm512_setr_epi32(
+      8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+
+    _mm512_storeu_ps(values, _mm512_permutex2var_ps(x, low, y));
+    _mm512_storeu_ps(values + 16, _mm512_permutex2var_ps(x, high, y));
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Gather(const float* values, Int index) noexcept
+  {
+    return _mm512_i32gather_ps(index, values, 4);
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Add(Float a, Float b) noexcept { return _mm512_add_ps(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Sub(Float a, Float b) noexcept { return _mm512_sub_ps(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Mul(Float a, Float b) noexcept
+  {
+    Float product = _mm512_mul_ps(a, b);
+    TINYERODE_UNFUSED(product);
+    return product;
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Div(Float a, Float b) noexcept { return _mm512_div_ps(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Min(Float a, Float b) noexcept { return _mm512_min_ps(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Max(Float a, Float b) noexcept { return _mm512_max_ps(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Sqrt(Float a) noexcept { return _mm512_sqrt_ps(a); }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Abs(Float a) noexcept { return _mm512_abs_ps(a); }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Neg(Float a) noexcept
+  {
+    return _mm512_castsi512_ps(
+      _mm512_xor_si512(_mm512_set1_epi32(int(0x80000000u)),
+                       _mm512_castps_si512(a)));
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static Mask Equal(Float a, Float b) noexcept
+  {
+    return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ);
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static Mask Greater(Float a, Float b) noexcept
+  {
+    return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static bool All(Mask mask) noexcept { return mask == 0xffff; }
+
+  TINYERODE_TARGET("avx512f")
+  static Float Select(Mask mask, Float a, Float b) noexcept
+  {
+    return _mm512_mask_blend_ps(mask, b, a);
+  }
+
+  TINYERODE_TARGET("avx512f")
+  static Int Add(Int a, Int b) noexcept { return _mm512_add_epi32(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Int Sub(Int a, Int b) noexcept { return _mm512_sub_epi32(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Int Mul(Int a, Int b) noexcept { return _mm512_mullo_epi32(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Int Min(Int a, Int b) noexcept { return _mm512_min_epi32(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Int Max(Int a, Int b) noexcept { return _mm512_max_epi32(a, b); }
+
+  TINYERODE_TARGET("avx512f")
+  static Int Truncate(Float a) noexcept { return _mm512_cvttps_epi32(a); }
+
+  TINYERODE_TARGET("avx512f")
+  static Float ToFloat(Int a) noexcept { return _mm512_cvtepi32_ps(a); }
+};
+
+#endif
+
+} // namespace SIMD
+
+/// Computes the flow of water out of each cell, and the tilt of the terrain.
+/// The scalar members of @ref BasicSimulation and the vectorized row loop both
+/// do their arithmetic with these functions, so their results are identical.
+struct FlowKernel final
+{
+  /// The parameters of the simulation, as vectors.
+  template<typename V>
+  struct Constants final
+  {
+    using Float = typename V::Float;
+
+    using Value = typename V::Value;
+
+    TINYERODE_INLINE Constants(Value timeStepValue,
+                               Value pipeArea,
+                               Value gravityValue,
+                               Value pipeLengthX,
+                               Value pipeLengthY) noexcept
+      : zero(V::Set(Value(0)))
+      , one(V::Set(Value(1)))
+      , timeStep(V::Set(timeStepValue))
+      , timeStepArea(V::Set(timeStepValue * pipeArea))
+      , gravity(V::Set(gravityValue))
+      , lengthX(V::Set(pipeLengthX))
+      , lengthY(V::Set(pipeLengthY))
+      , tiltX(V::Set(Value(2) * pipeLengthX))
+      , tiltY(V::Set(Value(2) * pipeLengthY))
+      , pipeLengths{ lengthY, lengthX, lengthX, lengthY }
+    {}
+
+    Float zero;
+
+    Float one;
+
+    Float timeStep;
+
+    Float timeStepArea;
+
+    Float gravity;
+
+    Float lengthX;
+
+    Float lengthY;
+
+    /// The distances between the neighbors that the tilt is computed from.
+    Float tiltX;
+
+    Float tiltY;
+
+    /// The length of the pipe to each neighbor, in the order -Y, -X, +X, +Y.
+    Float pipeLengths[4];
+  };
+
+  /// Updates the @p flow through the pipe from a cell to its neighbor in
+  /// direction @p i, given the water level of the cell (including the height
+  /// of the terrain) and the height and water of the neighbor.
+  template<typename V>
+  static TINYERODE_INLINE void ComputeOutflow(
+    const Constants<V>& c,
+    const typename V::Float& centerLevel,
+    const typename V::Float& neighborH,
+    const typename V::Float& neighborW,
+    int i,
+    typename V::Float& flow) noexcept
+  {
+    const auto heightDiff = V::Sub(centerLevel, V::Add(neighborH, neighborW));
+
+    const auto delta = V::Div(
+      V::Mul(c.timeStepArea, V::Mul(c.gravity, heightDiff)), c.pipeLengths[i]);
+
+    // Returns zero for NaN, like std::max(0, ...) does.
+    flow = V::Max(V::Add(flow, delta), c.zero);
+  }
+
+  /// Scales the outflow of a cell down, if it would drain more water than the
+  /// cell has.
+  template<typename V>
+  static TINYERODE_INLINE void LimitOutflow(
+    const Constants<V>& c,
+    const typename V::Float& centerW,
+    typename V::Float* flow) noexcept
+  {
+    using Float = typename V::Float;
+
+    const Float volume = V::Mul(
+      V::Add(V::Add(V::Add(flow[0], flow[1]), flow[2]), flow[3]), c.timeStep);
+
+    const Float capacity = V::Mul(V::Mul(centerW, c.lengthX), c.lengthY);
+
+    Float k = V::Min(V::Div(capacity, volume), c.one);
+
+    k = V::Select(V::Equal(volume, c.zero), c.one, k);
+
+    const auto scaled = V::Greater(volume, capacity);
+
+    for (int i = 0; i < 4; i++)
+      flow[i] = V::Select(scaled, V::Mul(flow[i], k), flow[i]);
+  }
+
+  /// Computes the tilt of a cell from its height and those of its four
+  /// neighbors, in the order -Y, -X, +X and +Y.
+  template<typename V>
+  static TINYERODE_INLINE void ComputeTilt(
+    const Constants<V>& c,
+    const typename V::Float& centerH,
+    const typename V::Float* heightNeighbors,
+    typename V::Float& tilt) noexcept
+  {
+    using Float = typename V::Float;
+
+    const Float avgDeltaY =
+      V::Div(V::Add(V::Sub(centerH, heightNeighbors[0]),
+                    V::Sub(heightNeighbors[3], centerH)),
+             c.tiltY);
+
+    const Float avgDeltaX =
+      V::Div(V::Add(V::Sub(centerH, heightNeighbors[1]),
+                    V::Sub(heightNeighbors[2], centerH)),
+             c.tiltX);
+
+    tilt = V::Sqrt(
+      V::Add(V::Mul(avgDeltaX, avgDeltaX), V::Mul(avgDeltaY, avgDeltaY)));
+  }
+
+#if TINYERODE_SIMD
+  /// Computes the cells of a row from @p x up to @p maxX, a vector at a time.
+  ///
+  /// @return The first cell that was not computed, because it did not fill a
+  ///         whole vector.
+  template<typename V>
+  static TINYERODE_INLINE int Run(const FlowRow& row, int x, int maxX) noexcept
+  {
+    using Float = typename V::Float;
+
+    const Constants<V> c(row.timeStep,
+                         row.pipeArea,
+                         row.gravity,
+                         row.pipeLengths[0],
+                         row.pipeLengths[1]);
+
+    for (; (x + V::Lanes) <= maxX; x += V::Lanes) {
+
+      const Float centerW = V::Load(row.water[1] + x);
+
+      const auto dry = V::Equal(centerW, c.zero);
+
+      if ((row.tilt == nullptr) && V::All(dry)) {
+        // Like in the scalar code, the heights are not needed at all.
+        for (int i = 0; i < 4; i++)
+          V::Store(row.flow[i] + x, c.zero);
+        continue;
+      }
+
+      const Float centerH = V::Load(row.height[1] + x);
+
+      const Float heightNeighbors[4] = { V::Load(row.height[0] + x),
+                                         V::Load(row.height[1] + x - 1),
+                                         V::Load(row.height[1] + x + 1),
+                                         V::Load(row.height[2] + x) };
+
+      const Float waterNeighbors[4] = { V::Load(row.water[0] + x),
+                                        V::Load(row.water[1] + x - 1),
+                                        V::Load(row.water[1] + x + 1),
+                                        V::Load(row.water[2] + x) };
+
+      const Float centerLevel = V::Add(centerH, centerW);
+
+      Float flow[4];
+
+      for (int i = 0; i < 4; i++) {
+
+        flow[i] = V::Load(row.flow[i] + x);
+
+        ComputeOutflow<V>(
+          c, centerLevel, heightNeighbors[i], waterNeighbors[i], i, flow[i]);
+      }
+
+      LimitOutflow<V>(c, centerW, flow);
+
+      for (int i = 0; i < 4; i++) {
+
+        // Dry cells get no outflow, unless their tilt is needed anyway.
+        if (row.tilt == nullptr)
+          flow[i] = V::Select(dry, c.zero, flow[i]);
+
+        V::Store(row.flow[i] + x, flow[i]);
+      }
+
+      if (row.tilt == nullptr)
+        continue;
+
+      Float tilt;
+
+      ComputeTilt<V>(c, centerH, heightNeighbors, tilt);
+
+      V::Store(row.tilt + x, tilt);
+    }
+
+    return x;
+  }
+#endif
+};
+
+/// Transports water between cells, and computes the velocity of the water in
+/// each one from the flow through it.
+struct WaterTransportKernel final
+{
+  /// The parameters of the simulation, as vectors.
+  template<typename V>
+  struct Constants final
+  {
+    using Float = typename V::Float;
+
+    using Value = typename V::Value;
+
+    TINYERODE_INLINE Constants(Value timeStepValue,
+                               Value pipeLengthX,
+                               Value pipeLengthY) noexcept
+      : zero(V::Set(Value(0)))
+      , half(V::Set(Value(0.5)))
+      , minLevel(V::Set(Value(1.0e-3)))
+      , timeStep(V::Set(timeStepValue))
+      , lengthX(V::Set(pipeLengthX))
+      , lengthY(V::Set(pipeLengthY))
+      , area(V::Set(pipeLengthX * pipeLengthY))
+    {}
+
+    Float zero;
+
+    Float half;
+
+    /// The water level below which the velocity is taken to be zero.
+    Float minLevel;
+
+    Float timeStep;
+
+    Float lengthX;
+
+    Float lengthY;
+
+    Float area;
+  };
+
+  /// Gets the change in the water level of a cell, given the flow into it from
+  /// each neighbor and the flow out of it to each neighbor.
+  template<typename V>
+  static TINYERODE_INLINE void ComputeWaterDelta(
+    const Constants<V>& c,
+    const typename V::Float* inflow,
+    const typename V::Float* outflow,
+    typename V::Float& waterDelta) noexcept
+  {
+    using Float = typename V::Float;
+
+    Float inflowSum = c.zero;
+    Float outflowSum = c.zero;
+
+    for (int i = 0; i < 4; i++) {
+      inflowSum = V::Add(inflowSum, inflow[i]);
+      outflowSum = V::Add(outflowSum, outflow[i]);
+    }
+
+    const Float volumeDelta =
+      V::Mul(V::Sub(inflowSum, outflowSum), c.timeStep);
+
+    waterDelta = V::Div(volumeDelta, c.area);
+  }
+
+  /// Gets how much water passes through a cell along each axis.
+  template<typename V>
+  static TINYERODE_INLINE void ComputeThroughflow(
+    const Constants<V>& c,
+    const typename V::Float* inflow,
+    const typename V::Float* outflow,
+    typename V::Float& dx,
+    typename V::Float& dy) noexcept
+  {
+    dx = V::Mul(
+      c.half,
+      V::Add(V::Sub(inflow[1], outflow[1]), V::Sub(outflow[2], inflow[2])));
+
+    dy = V::Mul(
+      c.half,
+      V::Add(V::Sub(outflow[3], inflow[3]), V::Sub(inflow[0], outflow[0])));
+  }
+
+  /// Computes the velocity of the water in a cell, from the water that passes
+  /// through it and its water level after the water was transported.
+  template<typename V>
+  static TINYERODE_INLINE void ComputeVelocity(
+    const Constants<V>& c,
+    const typename V::Float& waterLevel,
+    const typename V::Float& waterDelta,
+    const typename V::Float& evaporation,
+    const typename V::Float& dx,
+    const typename V::Float& dy,
+    typename V::Float& velX,
+    typename V::Float& velY) noexcept
+  {
+    using Float = typename V::Float;
+
+    // The velocity is computed from the level before evaporation, which can
+    // not be recovered for cells that have dried up.
+    const Float level = V::Select(V::Greater(waterLevel, c.zero),
+                                  V::Sub(waterLevel, evaporation),
+                                  waterLevel);
+
+    const Float avgWaterLevel = V::Add(level, V::Mul(waterDelta, c.half));
+
+    const auto wet = V::Greater(V::Abs(avgWaterLevel), c.minLevel);
+
+    velX = V::Select(wet, V::Div(dx, V::Mul(c.lengthX, avgWaterLevel)), c.zero);
+    velY = V::Select(wet, V::Div(dy, V::Mul(c.lengthY, avgWaterLevel)), c.zero);
+  }
+
+#if TINYERODE_SIMD
+  /// Transports the cells of a row from @p x up to @p maxX, a vector at a time.
+  /// The water is added like @ref BasicTerrain::AddWater does.
+  ///
+  /// @return The first cell that was not transported, because it did not fill
+  ///         a whole vector.
+  template<typename V>
+  static TINYERODE_INLINE int Run(const WaterRow& row, int x, int maxX) noexcept
+  {
+    using Float = typename V::Float;
+
+    const Constants<V> c(row.timeStep, row.pipeLengths[0], row.pipeLengths[1]);
+
+    const Float evaporation = V::Set(row.evaporation);
+
+    for (; (x + V::Lanes) <= maxX; x += V::Lanes) {
+
+      const Float flow[4] = { V::Load(row.flow[0] + x),
+                              V::Load(row.flow[1] + x),
+                              V::Load(row.flow[2] + x),
+                              V::Load(row.flow[3] + x) };
+
+      const Float inflow[4] = { V::Load(row.flow[3] + x - row.stride),
+                                V::Load(row.flow[2] + x - 1),
+                                V::Load(row.flow[1] + x + 1),
+                                V::Load(row.flow[0] + x + row.stride) };
+
+      Float waterDelta;
+
+      ComputeWaterDelta<V>(c, inflow, flow, waterDelta);
+
+      // Returns zero for NaN, like std::max(0, ...) does.
+      const Float waterLevel = V::Max(
+        V::Add(V::Load(row.water + x), V::Add(waterDelta, evaporation)),
+        c.zero);
+
+      V::Store(row.water + x, waterLevel);
+
+      Float dx;
+      Float dy;
+
+      ComputeThroughflow<V>(c, inflow, flow, dx, dy);
+
+      Float velX;
+      Float velY;
+
+      ComputeVelocity<V>(
+        c, waterLevel, waterDelta, evaporation, dx, dy, velX, velY);
+
+      V::StorePairs(row.velocity + (x * 2), velX, velY);
+    }
+
+    return x;
+  }
+#endif
+};
+
+/// Moves the sediment of each cell along the velocity of the water, by sampling
+/// the sediment where the water came from. The samples are clamped to the grid
+/// and its halo instead of checked, so the four samples of each cell are read
+/// without branches.
+struct AdvectionKernel final
+{
+  /// The parameters of the simulation, as vectors.
+  template<typename V>
+  struct Constants final
+  {
+    using Float = typename V::Float;
+
+    using Int = typename V::Int;
+
+    using Value = typename V::Value;
+
+    TINYERODE_INLINE Constants(Value timeStepValue,
+                               Value pipeLengthX,
+                               Value pipeLengthY,
+                               const std::array<int, 2>& minSample,
+                               const std::array<int, 2>& maxSample) noexcept
+      : timeStep(V::Set(timeStepValue))
+      , lengthX(V::Set(pipeLengthX))
+      , lengthY(V::Set(pipeLengthY))
+      , minX(V::Set(minSample[0]))
+      , minY(V::Set(minSample[1]))
+      , maxX(V::Set(maxSample[0]))
+      , maxY(V::Set(maxSample[1]))
+    {}
+
+    Float timeStep;
+
+    Float lengthX;
+
+    Float lengthY;
+
+    /// The range that the coordinates of the first sample are clamped to, so
+    /// that samples outside of the grid only read from the halo.
+    Int minX;
+
+    Int minY;
+
+    Int maxX;
+
+    Int maxY;
+  };
+
+  /// Finds where the water of a cell came from.
+  ///
+  /// @param sampleX Receives the X coordinate of the first of the four cells
+  ///                that are sampled. The others are to the right of it and
+  ///                below it.
+  ///
+  /// @param u Receives the weight of the samples to the right.
+  ///
+  /// @param v Receives the weight of the samples below.
+  template<typename V>
+  static TINYERODE_INLINE void FindSource(const Constants<V>& c,
+                                          const typename V::Float& cellX,
+                                          const typename V::Float& cellY,
+                                          const typename V::Float& velX,
+                                          const typename V::Float& velY,
+                                          typename V::Int& sampleX,
+                                          typename V::Int& sampleY,
+                                          typename V::Float& u,
+                                          typename V::Float& v) noexcept
+  {
+    using Float = typename V::Float;
+    using Int = typename V::Int;
+
+    const Float xf =
+      V::Sub(cellX, V::Div(V::Mul(velX, c.timeStep), c.lengthX));
+
+    const Float yf =
+      V::Sub(cellY, V::Div(V::Mul(velY, c.timeStep), c.lengthY));
+
+    const Int xfi = V::Truncate(xf);
+    const Int yfi = V::Truncate(yf);
+
+    u = V::Sub(xf, V::ToFloat(xfi));
+    v = V::Sub(yf, V::ToFloat(yfi));
+
+    sampleX = V::Min(V::Max(xfi, c.minX), c.maxX);
+    sampleY = V::Min(V::Max(yfi, c.minY), c.maxY);
+  }
+
+  /// Interpolates the four samples found by @ref FindSource, in the order top
+  /// left, top right, bottom left and bottom right.
+  template<typename V>
+  static TINYERODE_INLINE void Interpolate(const typename V::Float& u,
+                                           const typename V::Float& v,
+                                           const typename V::Float* s,
+                                           typename V::Float& value) noexcept
+  {
+    using Float = typename V::Float;
+
+    const Float sx1 = V::Add(s[0], V::Mul(u, V::Sub(s[1], s[0])));
+    const Float sx2 = V::Add(s[2], V::Mul(u, V::Sub(s[3], s[2])));
+
+    value = V::Add(sx1, V::Mul(v, V::Sub(sx2, sx1)));
+  }
+
+#if TINYERODE_SIMD
+  /// Advects the cells of a row from @p x up to @p maxX, a vector at a time.
+  ///
+  /// @return The first cell that was not advected, because it did not fill a
+  ///         whole vector.
+  template<typename V>
+  static TINYERODE_INLINE int Run(const AdvectionRow& row,
+                                  int x,
+                                  int maxX) noexcept
+  {
+    using Float = typename V::Float;
+    using Int = typename V::Int;
+
+    const Constants<V> c(row.timeStep,
+                         row.pipeLengths[0],
+                         row.pipeLengths[1],
+                         row.minSample,
+                         row.maxSample);
+
+    const Int stride = V::Set(row.stride);
+
+    const Float cellY = V::Set(float(row.y));
+
+    const float* s0 = row.sediment;
+    const float* s1 = row.sediment + 1;
+    const float* s2 = row.sediment + row.stride;
+    const float* s3 = row.sediment + row.stride + 1;
+
+    for (; (x + V::Lanes) <= maxX; x += V::Lanes) {
+
+      Float velX;
+      Float velY;
+
+      V::LoadPairs(row.velocity + (x * 2), velX, velY);
+
+      const Float cellX = V::ToFloat(V::Iota(x));
+
+      Int sampleX;
+      Int sampleY;
+
+      Float u;
+      Float v;
+
+      FindSource<V>(c, cellX, cellY, velX, velY, sampleX, sampleY, u, v);
+
+      const Int index = V::Add(V::Mul(sampleY, stride), sampleX);
+
+      const Float s[4] = { V::Gather(s0, index),
+                           V::Gather(s1, index),
+                           V::Gather(s2, index),
+                           V::Gather(s3, index) };
+
+      Float sediment;
+
+      Interpolate<V>(u, v, s, sediment);
+
+      V::Store(row.nextSediment + x, sediment);
+    }
+
+    return x;
+  }
+#endif
+};
+
+/// Erodes or deposits the sediment of each cell. The vectorized row loop picks
+/// between the erosion and deposition constants with a mask, because whether a
+/// cell can carry more sediment changes too often across a terrain for the
+/// branch to be predicted.
+struct ErosionKernel final
+{
+  /// Gets how much sediment the water in a cell can carry.
+  template<typename V>
+  static TINYERODE_INLINE void ComputeCapacity(
+    const typename V::Float& carryCapacity,
+    const typename V::Float& minTilt,
+    const typename V::Float& tilt,
+    const typename V::Float& velX,
+    const typename V::Float& velY,
+    typename V::Float& capacity) noexcept
+  {
+    const auto velocityMagnitude =
+      V::Sqrt(V::Add(V::Mul(velX, velX), V::Mul(velY, velY)));
+
+    // The operands are swapped so that NaN is handled like std::max does.
+    capacity =
+      V::Mul(V::Mul(carryCapacity, V::Max(tilt, minTilt)), velocityMagnitude);
+  }
+
+  /// Moves sediment between the terrain and the water of a cell, with @p
+  /// factor being the erosion constant if the water can carry more sediment
+  /// and the deposition constant otherwise.
+  template<typename V>
+  static TINYERODE_INLINE void Transfer(
+    const typename V::Float& factor,
+    const typename V::Float& capacity,
+    const typename V::Float& sediment,
+    typename V::Float& heightDelta,
+    typename V::Float& nextSediment) noexcept
+  {
+    const auto amount = V::Mul(factor, V::Sub(capacity, sediment));
+
+    heightDelta = V::Neg(amount);
+
+    nextSediment = V::Add(sediment, amount);
+  }
+
+#if TINYERODE_SIMD
+  /// Erodes the cells of a row from @p x up to @p maxX, a vector at a time.
+  ///
+  /// @return The first cell that was not eroded, because it did not fill a
+  ///         whole vector.
+  template<typename V>
+  static TINYERODE_INLINE int Run(const ErosionRow& row,
+                                  int x,
+                                  int maxX) noexcept
+  {
+    using Float = typename V::Float;
+
+    const Float carryCapacity = V::Set(row.carryCapacity);
+    const Float deposition = V::Set(row.deposition);
+    const Float erosion = V::Set(row.erosion);
+    const Float minTilt = V::Set(row.minTilt);
+
+    for (; (x + V::Lanes) <= maxX; x += V::Lanes) {
+
+      Float velX;
+      Float velY;
+
+      V::LoadPairs(row.velocity + (x * 2), velX, velY);
+
+      Float capacity;
+
+      ComputeCapacity<V>(
+        carryCapacity, minTilt, V::Load(row.tilt + x), velX, velY, capacity);
+
+      const Float sediment = V::Load(row.sediment + x);
+
+      const Float factor =
+        V::Select(V::Greater(capacity, sediment), erosion, deposition);
+
+      Float heightDelta;
+      Float nextSediment;
+
+      Transfer<V>(factor, capacity, sediment, heightDelta, nextSediment);
+
+      V::Store(row.heightDelta + x, heightDelta);
+
+      V::Store(row.sediment + x, nextSediment);
+    }
+
+    return x;
+  }
+#endif
+};
+
+#if TINYERODE_SIMD
+
+/// Runs a kernel with AVX-512 instructions. The kernel is inlined, so that it
+/// is compiled for them as well.
+template<typename Kernel, typename Row>
+TINYERODE_TARGET("avx512f")
+int
+RunKernelAVX512(const Row& row, int x, int maxX) noexcept
+{
+  return Kernel::template Run<SIMD::AVX512>(row, x, maxX);
+}
+
+/// Runs a kernel with AVX2 instructions.
+template<typename Kernel, typename Row>
+TINYERODE_TARGET("avx2")
+int
+RunKernelAVX2(const Row& row, int x, int maxX) noexcept
+{
+  return Kernel::template Run<SIMD::AVX2>(row, x, maxX);
+}
+
+/// Runs a kernel with SSE2 instructions.
+template<typename Kernel, typename Row>
+TINYERODE_TARGET("sse2")
+int
+RunKernelSSE2(const Row& row, int x, int maxX) noexcept
+{
+  return Kernel::template Run<SIMD::SSE2>(row, x, maxX);
+}
+
+/// Runs a kernel one cell at a time.
+template<typename Kernel, typename Row>
+inline int
+RunKernelScalar(const Row& row, int x, int maxX) noexcept
+{
+  return Kernel::template Run<SIMD::Serial<float>>(row, x, maxX);
+}
+
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#if TINYERODE_SIMD
+
+/// Runs a kernel on the cells of a row from @p x up to @p maxX, with the widest
+/// vectors allowed by @p instructionSet first, and narrower ones for the cells
+/// that are left over. The last few cells are computed one at a time.
+///
+/// @return The end of the row, @p maxX.
+template<typename Kernel, typename Row>
+inline int
+RunKernel(InstructionSet instructionSet,
+          const Row& row,
+          int x,
+          int maxX) noexcept
+{
+  if (instructionSet >= InstructionSet::AVX512)
+    x = RunKernelAVX512<Kernel>(row, x, maxX);
+
+  if (instructionSet >= InstructionSet::AVX2)
+    x = RunKernelAVX2<Kernel>(row, x, maxX);
+
+  if (instructionSet >= InstructionSet::SSE2)
+    x = RunKernelSSE2<Kernel>(row, x, maxX);
+
+  return RunKernelScalar<Kernel>(row, x, maxX);
+}
+
+#endif
+
+/// Used for simulating a rainfall event on a terrain.
+/// Stores information on the terrain that is required to simulate the effect of
+/// hydraulic erosion.
+///
+/// @tparam Scalar The type used for all of the arithmetic done by the
+///                simulation. Using double precision can be useful for
+///                validating results.
+///
+/// @tparam Storage The type used for storing the flow, velocity, sediment and
+///                 tilt of each cell. Values are always converted to @p Scalar
+///                 before they are used, so @ref Half or @ref BFloat16 can be
+///                 used to halve the memory and bandwidth of the simulation, at
+///                 the cost of some accuracy.
+///
+/// @tparam Allocator The allocator used for the grids of the simulation. It is
+///                   rebound to each type of cell that is stored. See @ref
+///                   AlignedAllocator for one that is suitable for very large
+///                   terrains.
+///
+/// @tparam Config The parameters of the simulation that are fixed at compile
+///                time. See @ref DynamicConfig.
+///
+/// @note The state of the simulation carries over between rainfall events, so
+///       @ref BasicSimulation::Reset should be called before each one.
+template<typename Scalar = float,
+         typename Storage = Scalar,
+         typename Allocator = std::allocator<Storage>,
+         typename Config = DynamicConfig>
+class BasicSimulation final
+{
+public:
+  /// The type of the grids that the state of each cell is stored in.
+  using StorageVector = std::vector<
+    Storage,
+    typename std::allocator_traits<Allocator>::template rebind_alloc<Storage>>;
+
+  BasicSimulation(int w = 0, int h = 0);
+
+  /// Sets the minimum tilt used for computing the carry capacity. This has no
+  /// effect if the configuration fixes it.
+  void SetMinTilt(const Scalar minTilt) noexcept { mMinTilt = minTilt; }
+
+  void SetTimeStep(Scalar timeStep) noexcept { mTimeStep = timeStep; }
+
+  /// Limits the instruction set used by the vectorized kernels, for example
+  /// to compare them against each other. By default, the widest one that is
+  /// supported is used. Instruction sets that are not supported are ignored.
+  void SetInstructionSet(InstructionSet instructionSet) noexcept
+  {
+    mInstructionSet = std::min(instructionSet, GetSupportedInstructionSet());
+  }
+
+  InstructionSet GetInstructionSet() const noexcept { return mInstructionSet; }
+
+  /// Indicates whether the vectorized kernels erode and deposit the sediment
+  /// when passed these types of carry capacity, deposition and erosion. They
+  /// have to be uniform (see @ref IsUniform), but may be of any arithmetic
+  /// type, since they are converted to @p Scalar the same way as in the
+  /// scalar kernels.
+  template<typename CarryCapacity, typename Deposition, typename Erosion>
+  static constexpr bool IsErosionVectorized() noexcept
+  {
+#if TINYERODE_SIMD
+    return CanVectorizeErosion<CarryCapacity, Deposition, Erosion>::value;
+#else
+    return false;
+#endif
+  }
+
+  Scalar GetTimeStep() const noexcept { return mTimeStep; }
+
+  int GetWidth() const noexcept { return mSize[0]; }
+
+  int GetHeight() const noexcept { return mSize[1]; }
+
+  /// Called at the beginning of each iteration.
+  /// This function will compute the flow rate of each cell, based on the level
+  /// of water and the elevation at each point in the height map.
+  ///
+  /// @param height The function taking an x and y coordinate and returning the
+  ///               height value at each point in the map.
+  ///
+  /// @param water The function taking an x and y coordinate and returning the
+  ///              water level at each point in the map. The water levels can be
+  ///              initialized to simulate rainfall or river streams.
+  template<typename Height, typename Water>
+  void ComputeFlowAndTilt(const Height& height, const Water& water);
+
+  /// This function is called after @ref BasicSimulation::ComputeFlow in order
+  /// to determine where the water at each cell is going to be moving.
+  ///
+  /// @param waterAdder A function taking an x and y coordinate as well as a
+  ///                   water value to be added to a cell within the water
+  ///                   model.
+  template<typename WaterAdder>
+  void TransportWater(WaterAdder waterAdder);
+
+  /// Transports water like the other overload, and also evaporates it. It can
+  /// be used instead of calling @ref BasicSimulation::Evaporate at the end of
+  /// an iteration when the exact results do not matter, and saves a pass over
+  /// the water model, since the transported and evaporated water of each cell
+  /// are added to it with a single call to @p waterAdder.
+  ///
+  /// @param waterAdder See the other overload.
+  ///
+  /// @param kEvap See @ref BasicSimulation::Evaporate.
+  ///
+  /// @note This is not a drop-in replacement for calling @ref
+  ///       BasicSimulation::Evaporate after @ref
+  ///       BasicSimulation::TransportSediment. The water is evaporated before
+  ///       the sediment is transported instead of after, and the results are
+  ///       close to but not the same. The transported and evaporated water are
+  ///       added in one step, which rounds differently, and the velocity is
+  ///       computed from the resulting level minus the evaporation. Cells that
+  ///       dry up in this step can not be given their level before
+  ///       evaporation back, so their velocity is computed from the level
+  ///       after it.
+  template<typename WaterAdder, typename Evaporation>
+  void TransportWater(WaterAdder waterAdder, Evaporation kEvap);
+
+  /// Transports water like the other overloads, adding it to the water level
+  /// of a terrain. The terrain has to be the same size as the simulation.
+  void TransportWater(BasicTerrain<Scalar>& terrain);
+
+  /// Transports and evaporates water like the overload taking a water adder,
+  /// adding it to the water level of a terrain. If the evaporation is uniform
+  /// (see @ref IsUniform), of any arithmetic type, both are done by the
+  /// vectorized kernels (see @ref TINYERODE_SIMD), as long as the flow is
+  /// stored in the SOA layout of the outflow model.
+  template<typename Evaporation>
+  void TransportWater(BasicTerrain<Scalar>& terrain, Evaporation kEvap);
+
+  /// Erodes and deposites sediment, and then moves remaining sediment based on
+  /// the velocity of the water at each cell.
+  ///
+  /// @param kC A function taking an x and y coordinate and returning the
+  ///           carry capacity constant at that particular location.
+  ///
+  /// @param kD A function taking an x and y coordinate and returning the
+  ///           deposition constant at that particular location.
+  ///
+  /// @param kE A function taking an x and y coordinate and returning the
+  ///           erosion constant at that particular location.
+  ///
+  /// @param heightAdder A function taking an x and y coordinate, as well as a
+  ///                    height delta, and adding the value to the height model.
+  ///
+  /// @note For simple models, @p kC, @p kD and @p kE can be single values, or
+  ///       instances of @ref Uniform. They are then read once instead of being
+  ///       called for every cell.
+  ///
+  /// @note This overload fails to compile when the configuration sets @ref
+  ///       DynamicConfig::RecomputeTilt, since the tilt is then computed from
+  ///       the height map.
+  template<typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder>
+  void TransportSediment(CarryCapacity kC,
+                         Deposition kD,
+                         Erosion kE,
+                         HeightAdder heightAdder);
+
+  /// Erodes and deposites sediment, and then moves remaining sediment based on
+  /// the velocity of the water at each cell. This overload works regardless of
+  /// @ref DynamicConfig::RecomputeTilt, so it is the one to use in code that
+  /// is meant to work with either setting.
+  ///
+  /// @param height The same height function that was passed to @ref
+  ///               BasicSimulation::ComputeFlowAndTilt. It has to reflect the
+  ///               changes made by @p heightAdder. It is only called when the
+  ///               configuration sets @ref DynamicConfig::RecomputeTilt.
+  ///
+  /// @param kC See the other overload.
+  ///
+  /// @param kD See the other overload.
+  ///
+  /// @param kE See the other overload.
+  ///
+  /// @param heightAdder See the other overload.
+  template<typename Height,
+           typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder>
+  void TransportSediment(const Height& height,
+                         CarryCapacity kC,
+                         Deposition kD,
+                         Erosion kE,
+                         HeightAdder heightAdder);
+
+  /// Evaporates water in the water model, based on evaporation constants.
+  ///
+  /// @param waterAdder A function taking an x and y coordiante as well as a
+  ///                   water value to be added to a cell within the water
+  ///                   model.
+  ///
+  /// @param kEvap A function taking an x and y coordinate and returning the
+  ///              evaporation constant at that particular location, or a
+  ///              single value that is used for every cell. It is the
+  ///              responsibility of @p waterAdder to ensure that the water
+  ///              level does not become negative at this step.
+  template<typename WaterAdder, typename Evaporation>
+  void Evaporate(WaterAdder water, Evaporation kEvap);
+
+  /// Runs a whole iteration of the simulation. The results are identical to
+  /// calling @ref BasicSimulation::ComputeFlowAndTilt, @ref
+  /// BasicSimulation::TransportWater, @ref BasicSimulation::TransportSediment
+  /// and @ref BasicSimulation::Evaporate in that order, but all except the
+  /// advection of sediment are done in a single sweep over the grid. When the
+  /// height and water models have row access, each row is therefore only
+  /// loaded from memory about twice per iteration, instead of once per step.
+  /// With models that are only read a cell at a time, it is slower than the
+  /// separate steps.
+  ///
+  /// The parameters are the same as those of the individual steps.
+  ///
+  /// @note Since the steps of a row are interleaved with those of the rows
+  ///       around it, the callbacks must not depend on state other than the
+  ///       height and water model they read and write.
+  template<typename Height,
+           typename Water,
+           typename WaterAdder,
+           typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder,
+           typename Evaporation>
+  void Step(const Height& height,
+            const Water& water,
+            WaterAdder waterAdder,
+            CarryCapacity kC,
+            Deposition kD,
+            Erosion kE,
+            HeightAdder heightAdder,
+            Evaporation kEvap);
+
+  /// Runs a whole iteration of the simulation on a terrain, like the other
+  /// overload. The terrain has to be the same size as the simulation.
+  template<typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename Evaporation>
+  void Step(BasicTerrain<Scalar>& terrain,
+            CarryCapacity kC,
+            Deposition kD,
+            Erosion kE,
+            Evaporation kEvap);
+
+  /// Deposites all currently suspended sediment into the terrain.
+  template<typename HeightAdder>
+  void TerminateRainfall(HeightAdder heightAdder);
+
+  /// Deposites all currently suspended sediment into the height map of a
+  /// terrain.
+  void TerminateRainfall(BasicTerrain<Scalar>& terrain);
+
+  /// Changes the size of the grid. The flow, sediment and velocity of every
+  /// cell are cleared, even if the size stays the same, since the previous
+  /// contents would no longer line up with the cells.
+  void Resize(int w, int h);
+
+  /// Clears the flow, sediment and velocity of every cell, so that the
+  /// simulation can be reused for another rainfall event. Unlike @ref
+  /// BasicSimulation::Resize, this does not release or allocate any memory.
+  void Reset();
+
+  /// Gets the sediment levels at each cell, one row after another. Useful
+  /// primarily for debugging.
+  std::vector<Scalar> GetSediment() const;
+
+  /// Gets the grid that the sediment levels are stored in, without copying it.
+  ///
+  /// @note The grid has a halo of two cells on each side, so the sediment of
+  ///       the cell at (x, y) is at the index ((y + 2) * (w + 4)) + (x + 2).
+  auto GetPaddedSediment() const noexcept -> const StorageVector&
+  {
+    return mSediment;
+  }
+
+  /// Sets the width of a cell, in meters. This has no effect if the
+  /// configuration fixes the size of the cells.
+  void SetMetersPerX(Scalar metersPerX) noexcept
+  {
+    mPipeLengths[0] = metersPerX;
+
+    InvalidateTilt();
+  }
+
+  /// Sets the height of a cell, in meters. This has no effect if the
+  /// configuration fixes the size of the cells.
+  void SetMetersPerY(Scalar metersPerY) noexcept
+  {
+    mPipeLengths[1] = metersPerY;
+
+    InvalidateTilt();
+  }
+
+  /// Sets whether @ref BasicSimulation::ComputeFlowAndTilt only recomputes the
+  /// tilt of the rows around those that were eroded since the last call. With
+  /// the outflow model, dry cells in the other rows do not have to read the
+  /// height map at all, since they have no outflow. On terrains that are mostly
+  /// dry, this saves most of the reads of the height map. The net flux model
+  /// still reads the height of every cell, since water can flow into a dry
+  /// cell through the pipes it updates. It is disabled by default.
+  ///
+  /// @note The simulation only knows about the changes it makes to the height
+  ///       map itself. If the height map is changed in any other way, call
+  ///       @ref BasicSimulation::InvalidateTilt afterwards.
+  ///
+  /// @note This has no effect when the configuration sets @ref
+  ///       DynamicConfig::RecomputeTilt, since the tilt is then not stored.
+  void SetIncrementalTilt(bool incremental) noexcept
+  {
+    mIncrementalTilt = incremental;
+  }
+
+  /// Makes the next call to @ref BasicSimulation::ComputeFlowAndTilt
+  /// recompute the tilt of every cell.
+  void InvalidateTilt() noexcept { Fill(mDirtyRows, std::uint8_t(1)); }
+
+private:
+  template<typename T>
+  using AllocatorFor =
+    typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+  template<typename T>
+  using Vector = std::vector<T, AllocatorFor<T>>;
+
+  using Velocity = std::array<Scalar, 2>;
+
+  using Flow = std::array<Scalar, 4>;
+
+  using StoredVelocity = std::array<Storage, 2>;
+
+  /// Indicates whether the vectorized kernels can run on this simulation at
+  /// all, in which case the scalar code has to give exactly the same results.
+  static constexpr bool HasVectorKernels =
+    TINYERODE_SIMD && std::is_same<Scalar, float>::value &&
+    std::is_same<Storage, float>::value;
+
+  /// The backend that the kernels compute a single cell with. Its products are
+  /// only kept unfused where there are vectorized kernels to match.
+  using Serial = SIMD::Serial<Scalar, HasVectorKernels>;
+
+  /// Computes the flow of a cell and, if @p computeTilt is set, its tilt. Dry
+  /// cells that do not need their tilt computed are handled without reading
+  /// the height map.
+  ///
+  /// @tparam Interior Whether all four neighbors of the cell are known to be
+  ///                  in the grid, in which case they are not checked.
+  template<bool Interior, typename Height, typename Water>
+  void ComputeFlowAndTiltAt(const Height& height,
+                            const Water& water,
+                            int x,
+                            int y,
+                            bool computeTilt);
+
+  /// Indicates whether the tilt of a row has to be computed again, because
+  /// the height of it or one of the rows next to it has changed.
+  bool IsTiltStale(int y) const noexcept
+  {
+    if (Config::RecomputeTilt)
+      return false;
+
+    if (!mIncrementalTilt)
+      return true;
+
+    return mDirtyRows[y] || ((y > 0) && mDirtyRows[y - 1]) ||
+           (((y + 1) < GetHeight()) && mDirtyRows[y + 1]);
+  }
+
+  /// Transports the water of a cell. The @p evaporation is added to the water
+  /// level along with the transported water, but is not used for computing
+  /// the velocity.
+  template<typename WaterAdder>
+  void TransportWaterAt(WaterAdder& water, Scalar evaporation, int x, int y);
+
+  /// Gets the change in the water level of a cell caused by evaporation.
+  template<typename Evaporation>
+  Scalar GetEvaporation(Evaporation& kEvap, int x, int y) const
+  {
+    return Serial::Mul(-mTimeStep, Scalar(Evaluate(kEvap, x, y)));
+  }
+
+  /// Adds water to a terrain. Unlike a lambda, it lets the kernels know that
+  /// they can write the water levels of a row of the terrain directly.
+  struct TerrainWaterAdder final
+  {
+    BasicTerrain<Scalar>* terrain;
+
+    Scalar operator()(int x, int y, Scalar waterDelta) const noexcept
+    {
+      return terrain->AddWater(x, y, waterDelta);
+    }
+  };
+
+  /// Transports the water of the cells from @p minX up to @p maxX in a row,
+  /// and evaporates it. Without evaporation, @p kEvap is @ref NoEvaporation.
+  template<typename WaterAdder, typename Evaporation>
+  void TransportWaterSpan(WaterAdder& water,
+                          Evaporation& kEvap,
+                          int y,
+                          int minX,
+                          int maxX)
+  {
+    for (int x = minX; x < maxX; x++)
+      TransportWaterAt(water, GetEvaporation(kEvap, x, y), x, y);
+  }
+
+  template<typename Evaporation>
+  void TransportWaterSpan(TerrainWaterAdder& water,
+                          Evaporation& kEvap,
+                          int y,
+                          int minX,
+                          int maxX);
+
+  /// Passed as the evaporation when water is only transported. It adds
+  /// nothing to the water level, so the results are the same as without it.
+  using NoEvaporation = Uniform<Scalar>;
+
+#if TINYERODE_SIMD
+  /// Transports the water of as many of the cells from @p minX up to @p maxX
+  /// as the vectorized kernels can.
+  ///
+  /// @return The first cell that is left for the scalar kernel.
+  template<typename Evaporation>
+  int TransportWaterVectorized(TerrainWaterAdder& water,
+                               Evaporation& kEvap,
+                               int y,
+                               int minX,
+                               int maxX,
+                               std::true_type);
+
+  template<typename Evaporation>
+  int TransportWaterVectorized(TerrainWaterAdder&,
+                               Evaporation&,
+                               int,
+                               int minX,
+                               int,
+                               std::false_type) noexcept
+  {
+    return minX;
+  }
+#endif
+
+  /// Computes the tilt of a cell from its height and the height of its four
+  /// neighbors, in the order -Y, -X, +X and +Y. Neighbors outside of the grid
+  /// should have the height of the center cell.
+  Scalar ComputeTilt(Scalar centerH,
+                     const std::array<Scalar, 4>& heightNeighbors) const
+    noexcept;
+
+  /// The number of rows in each band of @ref BasicSimulation::Step, and of
+  /// the erosion pass when the tilt is recomputed. Bands are processed in
+  /// parallel, each one sweeping its rows from top to bottom.
+  static constexpr int BandSize = 64;
+
+  int GetBandCount() const noexcept
+  {
+    return (GetHeight() + BandSize - 1) / BandSize;
+  }
+
+  template<typename Height, typename Water>
+  void ComputeFlowAndTiltRow(const Height& height, const Water& water, int y);
+
+  /// Computes the flow and tilt of the cells from @p minX up to @p maxX in a
+  /// row. The cells along the edges of the grid are handled separately, so
+  /// that the loop over the others has no bounds checks.
+  template<typename Height, typename Water>
+  void ComputeFlowAndTiltSpan(const Height& height,
+                              const Water& water,
+                              int y,
+                              int minX,
+                              int maxX,
+                              bool computeTilt);
+
+#if TINYERODE_SIMD
+  /// Indicates whether the flow of a row can be computed by the vectorized
+  /// kernels, when the height and water are read with the given accessors.
+  template<typename Height, typename Water>
+  using CanVectorizeFlow =
+    std::integral_constant<bool,
+                           (Config::Model == FlowModel::Outflow) &&
+                             (Config::Layout == FlowLayout::SOA) &&
+                             std::is_same<Scalar, float>::value &&
+                             std::is_same<Storage, float>::value &&
+                             HasFloatRowAccess<Height>::value &&
+                             HasFloatRowAccess<Water>::value>;
+
+  /// Computes the flow and tilt of as many of the interior cells from @p minX
+  /// up to @p maxX as the vectorized kernels can.
+  ///
+  /// @return The first cell that is left for the scalar kernel.
+  template<typename HeightRows, typename WaterRows>
+  int ComputeFlowAndTiltVectorized(const HeightRows& heightRows,
+                                   const WaterRows& waterRows,
+                                   int y,
+                                   int minX,
+                                   int maxX,
+                                   bool computeTilt,
+                                   std::true_type);
+
+  template<typename HeightRows, typename WaterRows>
+  int ComputeFlowAndTiltVectorized(const HeightRows&,
+                                   const WaterRows&,
+                                   int,
+                                   int minX,
+                                   int,
+                                   bool,
+                                   std::false_type) noexcept
+  {
+    return minX;
+  }
+#endif
+
+  /// Gets the range of cells, within the cells from @p minX up to @p maxX in
+  /// a row, that have all four neighbors in the grid. The cells before and
+  /// after it are along the edges of the grid.
+  std::array<int, 2> GetInteriorSpan(int y, int minX, int maxX) const noexcept
+  {
+    if ((y <= 0) || ((y + 1) >= GetHeight()))
+      return std::array<int, 2>{ { maxX, maxX } };
+
+    const int first = std::min(std::max(minX, 1), maxX);
+
+    const int last = std::max(std::min(maxX, GetWidth() - 1), first);
+
+    return std::array<int, 2>{ { first, last } };
+  }
+
+  /// Gets one of the three rows of tilt values that belong to a band. The
+  /// first two are used in turn while sweeping the band and the last one holds
+  /// the tilt of the last row of the band.
+  Scalar* GetTiltRow(int band, int slot) noexcept
+  {
+    return mTiltRows.data() + (((band * 3) + slot) * GetWidth());
+  }
+
+  template<typename Height>
+  void ComputeTiltRow(const Height& height, int y, Scalar* tilt) const;
+
+  template<bool Interior, typename Height>
+  Scalar ComputeTiltAt(const Height& height, int x, int y) const;
+
+  /// Gets the value of a parameter at a cell. Single values are returned
+  /// as they are, without depending on the coordinates.
+  template<typename Parameter>
+  static auto Evaluate(Parameter& parameter, int x, int y)
+    -> decltype(parameter(x, y))
+  {
+    return parameter(x, y);
+  }
+
+  template<typename Parameter,
+           typename std::enable_if<std::is_arithmetic<Parameter>::value,
+                                   int>::type = 0>
+  static Parameter Evaluate(Parameter parameter, int, int) noexcept
+  {
+    return parameter;
+  }
+
+  /// Erodes or deposits sediment at a single cell.
+  ///
+  /// @return True if the height of the cell was changed.
+  template<typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder>
+  bool ErodeAndDeposit(CarryCapacity& kC,
+                       Deposition& kD,
+                       Erosion& kE,
+                       HeightAdder& heightAdder,
+                       Scalar tilt,
+                       int x,
+                       int y);
+
+  /// Moves the sediment of each cell along the velocity of the water.
+  void AdvectSediment();
+
+  /// Moves the sediment of a single cell, from the sediment that has been
+  /// eroded into the next sediment buffer.
+  void AdvectAt(int x, int y) noexcept;
+
+  /// Moves the sediment of the cells from @p minX up to @p maxX in a row.
+  void AdvectSpan(int y, int minX, int maxX) noexcept;
+
+#if TINYERODE_SIMD
+  /// Indicates whether the vectorized kernels can read and write the grids of
+  /// the simulation directly.
+  using CanVectorizeCells =
+    std::integral_constant<bool,
+                           std::is_same<Scalar, float>::value &&
+                             std::is_same<Storage, float>::value>;
+
+  /// Advects as many of the cells from @p minX up to @p maxX as the vectorized
+  /// kernels can.
+  ///
+  /// @return The first cell that is left for the scalar kernel.
+  int AdvectVectorized(int y, int minX, int maxX, std::true_type) noexcept;
+
+  int AdvectVectorized(int, int minX, int, std::false_type) noexcept
+  {
+    return minX;
+  }
+
+  /// Indicates whether the vectorized erosion kernels can be used with these
+  /// parameters. Uniform parameters of any type are converted to @p Scalar
+  /// once per row, which gives the same value as converting them at each cell.
+  template<typename CarryCapacity, typename Deposition, typename Erosion>
+  using CanVectorizeErosion =
+    std::integral_constant<bool,
+                           CanVectorizeCells::value &&
+                             IsUniform<CarryCapacity>::value &&
+                             IsUniform<Deposition>::value &&
+                             IsUniform<Erosion>::value>;
+
+  template<typename Evaporation>
+  using CanVectorizeWater =
+    std::integral_constant<bool,
+                           (Config::Model == FlowModel::Outflow) &&
+                             (Config::Layout == FlowLayout::SOA) &&
+                             CanVectorizeCells::value &&
+                             IsUniform<Evaporation>::value>;
+
+  /// The number of cells that the vectorized erosion kernels change at a time,
+  /// before their changes in height are passed on to the height model.
+  static constexpr int ErosionBatchSize = 256;
+
+  /// Erodes or deposits sediment at the cells of a row with the vectorized
+  /// kernels, reading the tilt of each cell from @p tilt.
+  ///
+  /// @return The first cell that is left for the scalar kernel.
+  template<typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder>
+  int ErodeAndDepositVectorized(CarryCapacity& kC,
+                                Deposition& kD,
+                                Erosion& kE,
+                                HeightAdder& heightAdder,
+                                const float* tilt,
+                                int y,
+                                bool& eroded,
+                                std::true_type);
+
+  template<typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder,
+           typename Tilt>
+  int ErodeAndDepositVectorized(CarryCapacity&,
+                                Deposition&,
+                                Erosion&,
+                                HeightAdder&,
+                                const Tilt*,
+                                int,
+                                bool&,
+                                std::false_type) noexcept
+  {
+    return 0;
+  }
+#endif
+
+  /// Erodes or deposits sediment at the cells of a row, reading the tilt of
+  /// each cell from @p tilt.
+  ///
+  /// @return Whether the height of any of the cells was changed.
+  template<typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder,
+           typename Tilt>
+  bool ErodeAndDepositRow(CarryCapacity& kC,
+                          Deposition& kD,
+                          Erosion& kE,
+                          HeightAdder& heightAdder,
+                          const Tilt* tilt,
+                          int y);
+
+  /// Erodes and deposits sediment with the tilt that was stored by @ref
+  /// BasicSimulation::ComputeFlowAndTilt.
+  template<typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder>
+  void ErodeWithStoredTilt(CarryCapacity& kC,
+                           Deposition& kD,
+                           Erosion& kE,
+                           HeightAdder& heightAdder);
+
+  /// Erodes and deposits sediment, recomputing the tilt from @p height. See
+  /// @ref DynamicConfig::RecomputeTilt.
+  template<typename Height,
+           typename CarryCapacity,
+           typename Deposition,
+           typename Erosion,
+           typename HeightAdder>
+  void ErodeWithRecomputedTilt(const Height& height,
+                               CarryCapacity& kC,
+                               Deposition& kD,
+                               Erosion& kE,
+                               HeightAdder& heightAdder);
+
+  /// Computes the flux through one pipe of @ref FlowModel::NetFlux, between a
+  /// cell and its neighbor in the positive X or Y direction. Unlike the
+  /// outflows, this has no vectorized version (see @ref FlowModel::NetFlux).
+  Scalar ComputeFlux(Scalar flux,
+                     Scalar centerH,
+                     Scalar centerW,
+                     Scalar neighborH,
+                     Scalar neighborW,
+                     Scalar pipeLength) const noexcept;
+
+  Flow LoadFlow(int index) const noexcept;
+
+  void StoreFlow(int index, const Flow& flow) noexcept;
+
+  /// Gets the outflow of a cell in a single direction.
+  Scalar GetFlow(int index, int direction) const noexcept
+  {
+    return Scalar(GetStoredFlow(index, direction));
+  }
+
+  static constexpr int FlowPlaneCount =
+    (Config::Model == FlowModel::NetFlux) ? 2 : 4;
+
+  /// Gets the position in @ref BasicSimulation::mFlow of the stored flow of a
+  /// cell, in one of the directions of the layout.
+  int GetFlowIndex(int index, int plane) const noexcept
+  {
+    if ((Config::Model == FlowModel::Outflow) &&
+        (Config::Layout == FlowLayout::AOS))
+      return (index * FlowPlaneCount) + plane;
+    else
+      return (plane * mCellCount) + index;
+  }
+
+  Storage& GetStoredFlow(int index, int plane) noexcept
+  {
+    return mFlow[GetFlowIndex(index, plane)];
+  }
+
+  const Storage& GetStoredFlow(int index, int plane) const noexcept
+  {
+    return mFlow[GetFlowIndex(index, plane)];
+  }
+
+  Velocity LoadVelocity(int index) const noexcept
+  {
+    const auto& velocity = mVelocity[index];
+
+    return Velocity{ { Scalar(velocity[0]), Scalar(velocity[1]) } };
+  }
+
+  Scalar GetGravity() const noexcept { return Scalar(Config::Gravity()); }
+
+  Scalar GetPipeArea() const noexcept { return Scalar(Config::PipeArea()); }
+
+  Scalar GetMinTilt() const noexcept
+  {
+    return Config::FixedMinTilt ? Scalar(Config::MinTilt()) : mMinTilt;
+  }
+
+  /// Gets the length of the pipes along the X axis (0) or the Y axis (1),
+  /// which is the width or height of a cell.
+  Scalar GetPipeLength(int axis) const noexcept
+  {
+    if (!Config::FixedCellSize)
+      return mPipeLengths[axis];
+
+    return Scalar(axis ? Config::MetersPerY() : Config::MetersPerX());
+  }
+
+  bool InBounds(int x, int y) const noexcept
+  {
+    return (x >= 0) && (x < GetWidth()) && (y >= 0) && (y < GetHeight());
+  }
+
+  FlowKernel::Constants<Serial> GetFlowConstants() const noexcept
+  {
+    return FlowKernel::Constants<Serial>(mTimeStep,
+                                         GetPipeArea(),
+                                         GetGravity(),
+                                         GetPipeLength(0),
+                                         GetPipeLength(1));
+  }
+
+  WaterTransportKernel::Constants<Serial> GetWaterConstants() const noexcept
+  {
+    return WaterTransportKernel::Constants<Serial>(
+      mTimeStep, GetPipeLength(0), GetPipeLength(1));
+  }
+
+  AdvectionKernel::Constants<Serial> GetAdvectionConstants() const noexcept
+  {
+    return AdvectionKernel::Constants<Serial>(
+      mTimeStep,
+      GetPipeLength(0),
+      GetPipeLength(1),
+      std::array<int, 2>{ { -Halo, -Halo } },
+      std::array<int, 2>{ { GetWidth() + Halo - 2, GetHeight() + Halo - 2 } });
+  }
+
+  Flow GetInflow(int x, int y) const noexcept;
+
+  /// The number of cells around the edge of the internal grids. The halo is
+  /// never written to, so its cells always read as zero flow and zero sediment,
+  /// which removes the bounds checks from the inflow and advection kernels. Two
+  /// cells are needed so that a bilinear sample that is entirely outside of the
+  /// grid can be clamped to one that reads only from the halo.
+  static constexpr int Halo = 2;
+
+  int GetStride() const noexcept { return GetWidth() + (Halo * 2); }
+
+  int ToIndex(int x, int y) const noexcept
+  {
+    return ((y + Halo) * GetStride()) + (x + Halo);
+  }
+
+  /// Calls @p kernel once for each span of cells in a row, in parallel, with
+  /// the row and the first and last (not inclusive) x coordinate of the span.
+  /// The kernel must therefore not depend on the order in which rows are
+  /// visited.
+  template<typename Kernel>
+  void ForEachSpan(const Kernel& kernel);
+
+  template<typename T>
+  static void Fill(Vector<T>& values, const T& value);
+
+private:
+  Scalar mTimeStep = 0.0125;
+
+  Scalar mMinTilt = Scalar(Config::MinTilt());
+
+  InstructionSet mInstructionSet = GetSupportedInstructionSet();
+
+  std::array<Scalar, 2> mPipeLengths{ { Scalar(Config::MetersPerX()),
+                                        Scalar(Config::MetersPerY()) } };
+
+  std::array<int, 2> mSize{ 0, 0 };
+
+  /// The number of cells in each of the internal grids, including the halo.
+  int mCellCount = 0;
+
+  /// The flow of each cell, in the model and layout selected by the
+  /// configuration. In @ref FlowModel::NetFlux, this is the signed flux through
+  /// the pipes in the positive X and Y direction.
+  Vector<Storage> mFlow;
+
+  Vector<Storage> mSediment;
+
+  /// The buffer that sediment is advected into. It is swapped with @ref
+  /// mSediment after each call to @ref TransportSediment, so that no memory
+  /// has to be allocated during the simulation.
+  Vector<Storage> mNextSediment;
+
+  Vector<StoredVelocity> mVelocity;
+
+  /// The rows of tilt values used by each band of the erosion pass, when the
+  /// tilt is recomputed. See @ref GetTiltRow for how they are laid out.
+  Vector<Scalar> mTiltRows;
+
+  /// The tilt of each cell, when it is stored. Only this or @ref mTiltRows is
+  /// allocated, depending on the configuration.
+  Vector<Storage> mTilt;
+
+  bool mIncrementalTilt = false;
+
+  /// Whether the height of any cell of each row has changed since the tilt was
+  /// last computed. This is empty when the tilt is recomputed.
+  Vector<std::uint8_t> mDirtyRows;
+};
+
+/// A single precision simulation using the default allocator.
+using Simulation = BasicSimulation<>;
+
+// Implementation details beyond this point.
+
+inline std::uint16_t
+Half::FromFloat(float value) noexcept
+{
+#ifdef __F16C__
+  return std::uint16_t(_cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT));
+#else
+  // Based on the round-to-nearest-even conversion by Fabian Giesen.
+
+  const std::uint32_t infinity = 255u << 23;
+  const std::uint32_t halfOverflow = (127u + 16u) << 23;
+  const std::uint32_t subnormalMagic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  const std::uint32_t sign = bits & 0x80000000u;
+
+  bits ^= sign;
+
+  std::uint32_t result;
+
+  if (bits >= halfOverflow) {
+    // Infinity stays infinity, and NaN becomes a quiet NaN.
+    result = (bits > infinity) ? 0x7e00u : 0x7c00u;
+  } else if (bits < (113u << 23)) {
+    // The result is subnormal, so the floating point unit is used to round the
+    // mantissa into the lowest ten bits.
+    float magic;
+    std::memcpy(&magic, &subnormalMagic, sizeof(magic));
+
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+
+    f += magic;
+
+    std::memcpy(&bits, &f, sizeof(bits));
+
+    result = bits - subnormalMagic;
+  } else {
+    const std::uint32_t mantissaOdd = (bits >> 13) & 1u;
+
+    bits += ((15u - 127u) << 23) + 0xfffu;
+    bits += mantissaOdd;
+
+    result = bits >> 13;
+  }
+
+  return std::uint16_t(result | (sign >> 16));
+#endif
+}
+
+inline float
+Half::ToFloat(std::uint16_t half) noexcept
+{
+#ifdef __F16C__
+  return _cvtsh_ss(half);
+#else
+  const std::uint32_t shiftedExponent = 0x7c00u << 13;
+
+  std::uint32_t bits = std::uint32_t(half & 0x7fffu) << 13;
+
+  const std::uint32_t exponent = bits & shiftedExponent;
+
+  bits += (127u - 15u) << 23;
+
+  if (exponent == shiftedExponent) {
+    // Infinity or NaN
+    bits += (128u - 16u) << 23;
+  } else if (exponent == 0) {
+    // Zero or subnormal, which is renormalized by the floating point unit.
+    bits += 1u << 23;
+
+    const std::uint32_t magicBits = 113u << 23;
+
+    float magic;
+    std::memcpy(&magic, &magicBits, sizeof(magic));
+
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+
+    f -= magic;
+
+    std::memcpy(&bits, &f, sizeof(bits));
+  }
+
+  bits |= std::uint32_t(half & 0x8000u) << 16;
+
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+#endif
+}
+
+inline std::uint16_t
+BFloat16::FromFloat(float value) noexcept
+{
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  // Keep NaN from being rounded into infinity.
+  if ((bits & 0x7fffffffu) > 0x7f800000u)
+    return std::uint16_t((bits >> 16) | 0x40u);
+
+  bits += 0x7fffu + ((bits >> 16) & 1u);
+
+  return std::uint16_t(bits >> 16);
+}
+
+template<typename T, std::size_t Alignment>
+T*
+AlignedAllocator<T, Alignment>::allocate(std::size_t count)
+{
+  if (count > (std::numeric_limits<std::size_t>::max() / sizeof(T)))
+    throw std::bad_alloc();
+
+  std::size_t size = count * sizeof(T);
+
+  std::size_t alignment = (Alignment > alignof(T)) ? Alignment : alignof(T);
+
+  if (size >= HugePageSize) {
+
+    if (alignment < HugePageSize)
+      alignment = HugePageSize;
+
+    // Rounded up, so that the advice only covers memory owned by this block.
+    size = ((size + HugePageSize - 1) / HugePageSize) * HugePageSize;
+  }
+
+  void* ptr = nullptr;
+
+#ifdef _WIN32
+  ptr = _aligned_malloc(size, alignment);
+#else
+  if (posix_memalign(&ptr, alignment, size) != 0)
+    ptr = nullptr;
+#endif
+
+  if (!ptr)
+    throw std::bad_alloc();
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (size >= HugePageSize)
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+  return static_cast<T*>(ptr);
+}
+
+template<typename T, std::size_t Alignment>
+void
+AlignedAllocator<T, Alignment>::deallocate(T* ptr, std::size_t) noexcept
+{
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+BasicSimulation<Scalar, Storage, Allocator, Config>::BasicSimulation(int w,
+                                                                     int h)
+{
+  Resize(w, h);
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename WaterAdder>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportWater(
+  WaterAdder water)
+{
+  TransportWater(water, NoEvaporation(Scalar(0)));
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportWater(
+  BasicTerrain<Scalar>& terrain)
+{
+  assert(terrain.GetWidth() == GetWidth());
+  assert(terrain.GetHeight() == GetHeight());
+
+  TransportWater(TerrainWaterAdder{ &terrain });
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Evaporation>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportWater(
+  BasicTerrain<Scalar>& terrain,
+  Evaporation kEvap)
+{
+  assert(terrain.GetWidth() == GetWidth());
+  assert(terrain.GetHeight() == GetHeight());
+
+  TransportWater(TerrainWaterAdder{ &terrain }, kEvap);
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Evaporation>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportWaterSpan(
+  TerrainWaterAdder& water,
+  Evaporation& kEvap,
+  int y,
+  int minX,
+  int maxX)
+{
+  int x = minX;
+
+#if TINYERODE_SIMD
+  x = TransportWaterVectorized(
+    water, kEvap, y, minX, maxX, CanVectorizeWater<Evaporation>());
+#endif
+
+  for (; x < maxX; x++)
+    TransportWaterAt(water, GetEvaporation(kEvap, x, y), x, y);
+}
+
+#if TINYERODE_SIMD
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Evaporation>
+int
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportWaterVectorized(
+  TerrainWaterAdder& water,
+  Evaporation& kEvap,
+  int y,
+  int minX,
+  int maxX,
+  std::true_type)
+{
+  WaterRow row;
+
+  const int offset = ToIndex(0, y);
+
+  for (int i = 0; i < 4; i++)
+    row.flow[i] = &GetStoredFlow(offset, i);
+
+  row.stride = GetStride();
+  row.water = water.terrain->GetWaterMap().row(y);
+  row.velocity = reinterpret_cast<float*>(mVelocity.data() + offset);
+  row.timeStep = mTimeStep;
+  row.evaporation = GetEvaporation(kEvap, 0, y);
+  row.pipeLengths = std::array<float, 2>{ { GetPipeLength(0),
+                                            GetPipeLength(1) } };
+
+  return RunKernel<WaterTransportKernel>(mInstructionSet, row, minX, maxX);
+}
+
+#endif
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename WaterAdder, typename Evaporation>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportWater(
+  WaterAdder water,
+  Evaporation kEvap)
+{
+  ForEachSpan([this, &water, &kEvap](int y, int minX, int maxX) {
+    TransportWaterSpan(water, kEvap, y, minX, maxX);
+  });
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename WaterAdder>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportWaterAt(
+  WaterAdder& water,
+  Scalar evaporation,
+  int x,
+  int y)
+{
+  const auto c = GetWaterConstants();
+
+  Scalar waterDelta;
+  Scalar waterLevel;
+
+  Scalar dx;
+  Scalar dy;
+
+  if (Config::Model == FlowModel::NetFlux) {
+    auto index = ToIndex(x, y);
+
+    Scalar east = GetFlow(index, 0);
+    Scalar south = GetFlow(index, 1);
+    Scalar west = GetFlow(ToIndex(x - 1, y), 0);
+    Scalar north = GetFlow(ToIndex(x, y - 1), 1);
+
+    auto volumeDelta = ((west - east) + (north - south)) * mTimeStep;
+
+    waterDelta = volumeDelta / (GetPipeLength(0) * GetPipeLength(1));
+
+    waterLevel = water(x, y, waterDelta + evaporation);
+
+    dx = Scalar(0.5) * (west + east);
+    dy = Scalar(0.5) * (north + south);
+  } else {
+    auto flow = LoadFlow(ToIndex(x, y));
+
+    auto inflow = GetInflow(x, y);
+
+    WaterTransportKernel::ComputeWaterDelta<Serial>(
+      c, inflow.data(), flow.data(), waterDelta);
+
+    waterLevel = water(x, y, waterDelta + evaporation);
+
+    WaterTransportKernel::ComputeThroughflow<Serial>(
+      c, inflow.data(), flow.data(), dx, dy);
+  }
+
+  Velocity velocity;
+
+  WaterTransportKernel::ComputeVelocity<Serial>(c,
+                                                waterLevel,
+                                                waterDelta,
+                                                evaporation,
+                                                dx,
+                                                dy,
+                                                velocity[0],
+                                                velocity[1]);
+
+  mVelocity[ToIndex(x, y)] =
+    StoredVelocity{ { Storage(velocity[0]), Storage(velocity[1]) } };
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Height, typename Water>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::ComputeFlowAndTilt(
+  const Height& height,
+  const Water& water)
+{
+  ForEachSpan([this, &height, &water](int y, int minX, int maxX) {
+    ComputeFlowAndTiltSpan(height, water, y, minX, maxX, IsTiltStale(y));
+  });
+
+  Fill(mDirtyRows, std::uint8_t(0));
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Height, typename Water>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::ComputeFlowAndTiltRow(
+  const Height& height,
+  const Water& water,
+  int y)
+{
+  ComputeFlowAndTiltSpan(height, water, y, 0, GetWidth(), IsTiltStale(y));
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Height, typename Water>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::ComputeFlowAndTiltSpan(
+  const Height& height,
+  const Water& water,
+  int y,
+  int minX,
+  int maxX,
+  bool computeTilt)
+{
+  const auto heightRows = MakeRowWindow(height, y, GetHeight());
 
-  /// Gets the sediment levels at each cell. Useful primarily for debugging.
-  auto GetSediment() const noexcept -> const std::vector<float>&
-  {
-    return mSediment;
-  }
+  const auto waterRows = MakeRowWindow(water, y, GetHeight());
 
-  void SetMetersPerX(float metersPerX) noexcept
-  {
-    mPipeLengths[0] = metersPerX;
-  }
+  const auto interior = GetInteriorSpan(y, minX, maxX);
 
-  void SetMetersPerY(float metersPerY) noexcept
-  {
-    mPipeLengths[1] = metersPerY;
-  }
+  for (int x = minX; x < interior[0]; x++)
+    ComputeFlowAndTiltAt<false>(heightRows, waterRows, x, y, computeTilt);
 
-private:
-  using Velocity = std::array<float, 2>;
+  int x = interior[0];
 
-  using Flow = std::array<float, 4>;
+#if TINYERODE_SIMD
+  x = ComputeFlowAndTiltVectorized(heightRows,
+                                   waterRows,
+                                   y,
+                                   x,
+                                   interior[1],
+                                   computeTilt,
+                                   CanVectorizeFlow<Height, Water>());
+#endif
 
-  template<typename Height, typename Water>
-  void ComputeFlowAndTiltAt(const Height& height,
-                            const Water& water,
-                            int x,
-                            int y);
+  for (; x < interior[1]; x++)
+    ComputeFlowAndTiltAt<true>(heightRows, waterRows, x, y, computeTilt);
 
-  template<typename WaterAdder>
-  void TransportWaterAt(WaterAdder& water, int x, int y);
+  for (x = interior[1]; x < maxX; x++)
+    ComputeFlowAndTiltAt<false>(heightRows, waterRows, x, y, computeTilt);
+}
 
-  template<typename CarryCapacity,
-           typename Deposition,
-           typename Erosion,
-           typename HeightAdder>
-  void ErodeAndDeposit(CarryCapacity& kC,
-                       Deposition& kD,
-                       Erosion& kE,
-                       HeightAdder& heightAdder,
-                       int x,
-                       int y);
+#if TINYERODE_SIMD
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename HeightRows, typename WaterRows>
+int
+BasicSimulation<Scalar, Storage, Allocator, Config>::
+  ComputeFlowAndTiltVectorized(const HeightRows& heightRows,
+                               const WaterRows& waterRows,
+                               int y,
+                               int minX,
+                               int maxX,
+                               bool computeTilt,
+                               std::true_type)
+{
+  FlowRow row;
 
-  const Flow& GetFlow(int x, int y) const noexcept
-  {
-    return mFlow[(y * GetWidth()) + x];
+  for (int i = 0; i < 3; i++) {
+    row.height[i] = heightRows.GetRow(y + i - 1);
+    row.water[i] = waterRows.GetRow(y + i - 1);
   }
 
-  Flow& GetFlow(int x, int y) noexcept { return mFlow[(y * GetWidth()) + x]; }
+  const int offset = ToIndex(0, y);
 
-  bool InBounds(int x, int y) const noexcept
-  {
-    return (x >= 0) && (x < GetWidth()) && (y >= 0) && (y < GetHeight());
-  }
+  for (int i = 0; i < 4; i++)
+    row.flow[i] = &GetStoredFlow(offset, i);
 
-  Flow GetInflow(int x, int y) const noexcept;
+  row.tilt = nullptr;
 
-  float GetScalingFactor(const Flow& flow, float waterLevel) noexcept;
+  if (!Config::RecomputeTilt && computeTilt)
+    row.tilt = mTilt.data() + offset;
 
-  int ToIndex(int x, int y) const noexcept { return (y * GetWidth()) + x; }
+  row.timeStep = mTimeStep;
+  row.pipeArea = GetPipeArea();
+  row.gravity = GetGravity();
+  row.pipeLengths = std::array<float, 2>{ { GetPipeLength(0),
+                                            GetPipeLength(1) } };
 
-private:
-  float mTimeStep = 0.0125;
+  return RunKernel<FlowKernel>(mInstructionSet, row, minX, maxX);
+}
 
-  float mMinTilt = 0.01;
+#endif
 
-  float mGravity = 9.8;
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Height,
+         typename Water,
+         typename WaterAdder,
+         typename CarryCapacity,
+         typename Deposition,
+         typename Erosion,
+         typename HeightAdder,
+         typename Evaporation>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::Step(
+  const Height& height,
+  const Water& water,
+  WaterAdder waterAdder,
+  CarryCapacity kC,
+  Deposition kD,
+  Erosion kE,
+  HeightAdder heightAdder,
+  Evaporation kEvap)
+{
+  // The flow of a row is computed from the rows above and below it, before
+  // their water and height is changed. Within a band, the flow of the next row
+  // is therefore computed before the water of the current row is transported.
+  // The first and last row of each band read rows of the neighboring bands, so
+  // their flow is computed up front.
 
-  std::array<float, 2> mPipeLengths{ 1, 1 };
+  const int bandCount = GetBandCount();
 
-  std::array<int, 2> mSize{ 0, 0 };
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 
-  std::vector<Flow> mFlow;
+  for (int band = 0; band < bandCount; band++) {
 
-  std::vector<float> mSediment;
+    const int firstY = band * BandSize;
+    const int lastY = std::min(firstY + BandSize, GetHeight()) - 1;
 
-  std::vector<Velocity> mVelocity;
+    ComputeFlowAndTiltRow(height, water, firstY);
 
-  std::vector<float> mTilt;
-};
+    if (lastY != firstY)
+      ComputeFlowAndTiltRow(height, water, lastY);
 
-// Implementation details beyond this point.
+    if (Config::RecomputeTilt) {
+      ComputeTiltRow(height, firstY, GetTiltRow(band, 0));
 
-inline Simulation::Simulation(int w, int h)
-{
-  Resize(w, h);
-}
+      ComputeTiltRow(height, lastY, GetTiltRow(band, 2));
+    }
+  }
 
-template<typename WaterAdder>
-void
-Simulation::TransportWater(WaterAdder water)
-{
 #ifdef _OPENMP
 #pragma omp parallel for
 #endif
 
-  for (int y = 0; y < GetHeight(); y++) {
-    for (int x = 0; x < GetWidth(); x++) {
-      TransportWaterAt(water, x, y);
+  for (int band = 0; band < bandCount; band++) {
+
+    const int firstY = band * BandSize;
+    const int lastY = std::min(firstY + BandSize, GetHeight()) - 1;
+
+    // The water is evaporated after the sediment is eroded, like it is when
+    // calling the functions that this replaces.
+    NoEvaporation noEvaporation(Scalar(0));
+
+    for (int y = firstY; y <= lastY; y++) {
+
+      if ((y + 1) < lastY) {
+
+        ComputeFlowAndTiltRow(height, water, y + 1);
+
+        if (Config::RecomputeTilt)
+          ComputeTiltRow(
+            height, y + 1, GetTiltRow(band, (y + 1 - firstY) % 2));
+      }
+
+      TransportWaterSpan(waterAdder, noEvaporation, y, 0, GetWidth());
+
+      bool eroded;
+
+      if (Config::RecomputeTilt) {
+        const Scalar* tilt =
+          GetTiltRow(band, (y == lastY) ? 2 : ((y - firstY) % 2));
+
+        eroded = ErodeAndDepositRow(kC, kD, kE, heightAdder, tilt, y);
+      } else {
+        const Storage* tilt = mTilt.data() + ToIndex(0, y);
+
+        eroded = ErodeAndDepositRow(kC, kD, kE, heightAdder, tilt, y);
+      }
+
+      for (int x = 0; x < GetWidth(); x++)
+        waterAdder(x, y, GetEvaporation(kEvap, x, y));
+
+      // The flow of this row and the rows next to it has already been
+      // computed, so the flag can be replaced instead of being merged.
+      if (!Config::RecomputeTilt)
+        mDirtyRows[y] = eroded;
     }
   }
+
+  AdvectSediment();
 }
 
-template<typename WaterAdder>
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename CarryCapacity,
+         typename Deposition,
+         typename Erosion,
+         typename Evaporation>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::Step(
+  BasicTerrain<Scalar>& terrain,
+  CarryCapacity kC,
+  Deposition kD,
+  Erosion kE,
+  Evaporation kEvap)
+{
+  assert(terrain.GetWidth() == GetWidth());
+  assert(terrain.GetHeight() == GetHeight());
+
+  TerrainWaterAdder addWater{ &terrain };
+
+  auto addHeight = [&terrain](int x, int y, Scalar heightDelta) {
+    terrain.AddHeight(x, y, heightDelta);
+  };
+
+  Step(terrain.GetHeightMap(),
+       terrain.GetWaterMap(),
+       addWater,
+       kC,
+       kD,
+       kE,
+       addHeight,
+       kEvap);
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<bool Interior, typename Height, typename Water>
 void
-Simulation::TransportWaterAt(WaterAdder& water, int x, int y)
+BasicSimulation<Scalar, Storage, Allocator, Config>::ComputeFlowAndTiltAt(
+  const Height& height,
+  const Water& water,
+  int x,
+  int y,
+  bool computeTilt)
 {
-  auto& flow = GetFlow(x, y);
+  Scalar centerW = water(x, y);
+
+  if ((Config::Model == FlowModel::Outflow) && !computeTilt &&
+      (centerW == Scalar(0))) {
+    // Any outflow of a dry cell would be scaled down to zero below.
+    StoreFlow(ToIndex(x, y), Flow{ { 0, 0, 0, 0 } });
+    return;
+  }
 
-  auto inflow = GetInflow(x, y);
+  Scalar centerH = height(x, y);
 
-  auto inflowSum = std::accumulate(inflow.begin(), inflow.end(), 0.0f);
+  std::array<Scalar, 4> heightNeighbors{ centerH, centerH, centerH, centerH };
 
-  auto outflowSum = std::accumulate(flow.begin(), flow.end(), 0.0f);
+  if (Config::Model == FlowModel::NetFlux) {
+    auto index = ToIndex(x, y);
 
-  auto volumeDelta = (inflowSum - outflowSum) * mTimeStep;
+    if (Interior || InBounds(x, y - 1))
+      heightNeighbors[0] = height(x, y - 1);
 
-  auto waterDelta = volumeDelta / (mPipeLengths[0] * mPipeLengths[1]);
+    if (Interior || InBounds(x - 1, y))
+      heightNeighbors[1] = height(x - 1, y);
 
-  float waterLevel = water(x, y, waterDelta);
+    // Each cell only updates the pipes leading to its neighbors in the positive
+    // X and Y direction, so that every pipe is written exactly once.
 
-  // Compute Water Velocity
+    if (Interior || InBounds(x + 1, y)) {
+      heightNeighbors[2] = height(x + 1, y);
+      GetStoredFlow(index, 0) = Storage(ComputeFlux(GetFlow(index, 0),
+                                                    centerH,
+                                                    centerW,
+                                                    heightNeighbors[2],
+                                                    water(x + 1, y),
+                                                    GetPipeLength(0)));
+    }
+
+    if (Interior || InBounds(x, y + 1)) {
+      heightNeighbors[3] = height(x, y + 1);
+      GetStoredFlow(index, 1) = Storage(ComputeFlux(GetFlow(index, 1),
+                                                    centerH,
+                                                    centerW,
+                                                    heightNeighbors[3],
+                                                    water(x, y + 1),
+                                                    GetPipeLength(1)));
+    }
+  } else {
+    auto flow = LoadFlow(ToIndex(x, y));
+
+    std::array<int, 4> xDeltas{ { 0, -1, 1, 0 } };
+    std::array<int, 4> yDeltas{ { -1, 0, 0, 1 } };
+
+    const auto c = GetFlowConstants();
+
+    for (int i = 0; i < 4; i++) {
+
+      auto neighborX = x + xDeltas[i];
+      auto neighborY = y + yDeltas[i];
+
+      if (!Interior && !InBounds(neighborX, neighborY))
+        continue;
 
-  float dx = 0.5f * ((inflow[1] - flow[1]) + (flow[2] - inflow[2]));
-  float dy = 0.5f * ((flow[3] - inflow[3]) + (inflow[0] - flow[0]));
+      heightNeighbors[i] = height(neighborX, neighborY);
 
-  float avgWaterLevel = waterLevel + (waterDelta * 0.5f);
+      FlowKernel::ComputeOutflow<Serial>(c,
+                                         centerH + centerW,
+                                         heightNeighbors[i],
+                                         water(neighborX, neighborY),
+                                         i,
+                                         flow[i]);
+    }
 
-  Velocity velocity{ { 0, 0 } };
+    FlowKernel::LimitOutflow<Serial>(c, centerW, flow.data());
 
-  if (std::abs(avgWaterLevel) > 1.0e-3f) {
-    velocity[0] = dx / (mPipeLengths[0] * avgWaterLevel);
-    velocity[1] = dy / (mPipeLengths[1] * avgWaterLevel);
+    StoreFlow(ToIndex(x, y), flow);
   }
 
-  mVelocity[ToIndex(x, y)] = velocity;
+  if (!Config::RecomputeTilt && computeTilt)
+    mTilt[ToIndex(x, y)] = Storage(ComputeTilt(centerH, heightNeighbors));
 }
 
-template<typename Height, typename Water>
-void
-Simulation::ComputeFlowAndTilt(const Height& height, const Water& water)
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+Scalar
+BasicSimulation<Scalar, Storage, Allocator, Config>::ComputeTilt(
+  Scalar centerH,
+  const std::array<Scalar, 4>& heightNeighbors) const noexcept
 {
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif
+  Scalar tilt;
 
-  for (int y = 0; y < GetHeight(); y++) {
-    for (int x = 0; x < GetWidth(); x++)
-      ComputeFlowAndTiltAt(height, water, x, y);
-  }
+  FlowKernel::ComputeTilt<Serial>(
+    GetFlowConstants(), centerH, heightNeighbors.data(), tilt);
+
+  return tilt;
 }
 
-template<typename Height, typename Water>
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Height>
 void
-Simulation::ComputeFlowAndTiltAt(const Height& height,
-                                 const Water& water,
-                                 int x,
-                                 int y)
+BasicSimulation<Scalar, Storage, Allocator, Config>::ComputeTiltRow(
+  const Height& height,
+  int y,
+  Scalar* tilt) const
 {
-  auto& center = GetFlow(x, y);
-
-  std::array<int, 4> xDeltas{ { 0, -1, 1, 0 } };
-  std::array<int, 4> yDeltas{ { -1, 0, 0, 1 } };
+  const auto heightRows = MakeRowWindow(height, y, GetHeight());
 
-  auto centerH = height(x, y);
-  auto centerW = water(x, y);
+  const auto interior = GetInteriorSpan(y, 0, GetWidth());
 
-  std::array<float, 4> heightNeighbors{ centerH, centerH, centerH, centerH };
+  for (int x = 0; x < interior[0]; x++)
+    tilt[x] = ComputeTiltAt<false>(heightRows, x, y);
 
-  std::array<int, 4> pipeLengthIndices{ { 1, 0, 0, 1 } };
+  for (int x = interior[0]; x < interior[1]; x++)
+    tilt[x] = ComputeTiltAt<true>(heightRows, x, y);
 
-  for (int i = 0; i < 4; i++) {
+  for (int x = interior[1]; x < GetWidth(); x++)
+    tilt[x] = ComputeTiltAt<false>(heightRows, x, y);
+}
 
-    auto neighborX = x + xDeltas[i];
-    auto neighborY = y + yDeltas[i];
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<bool Interior, typename Height>
+Scalar
+BasicSimulation<Scalar, Storage, Allocator, Config>::ComputeTiltAt(
+  const Height& height,
+  int x,
+  int y) const
+{
+  Scalar centerH = height(x, y);
 
-    if (!InBounds(neighborX, neighborY))
-      continue;
+  std::array<Scalar, 4> heightNeighbors{ centerH, centerH, centerH, centerH };
 
-    heightNeighbors[i] = height(neighborX, neighborY);
+  if (Interior || InBounds(x, y - 1))
+    heightNeighbors[0] = height(x, y - 1);
 
-    auto neighborH = heightNeighbors[i];
+  if (Interior || InBounds(x - 1, y))
+    heightNeighbors[1] = height(x - 1, y);
 
-    auto neighborW = water(neighborX, neighborY);
+  if (Interior || InBounds(x + 1, y))
+    heightNeighbors[2] = height(x + 1, y);
 
-    auto heightDiff = (centerH + centerW) - (neighborH + neighborW);
+  if (Interior || InBounds(x, y + 1))
+    heightNeighbors[3] = height(x, y + 1);
 
-    // Cross sectional area of the virtual pipe.
-    float area = 1;
+  return ComputeTilt(centerH, heightNeighbors);
+}
 
-    // Length of the virtual pipe.
-    float pipeLength = mPipeLengths[pipeLengthIndices[i]];
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename CarryCapacity,
+         typename Deposition,
+         typename Erosion,
+         typename HeightAdder>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportSediment(
+  CarryCapacity kC,
+  Deposition kD,
+  Erosion kE,
+  HeightAdder heightAdder)
+{
+  static_assert(!Config::RecomputeTilt,
+                "The tilt is recomputed by this configuration, so the height "
+                "has to be passed to TransportSediment");
 
-    auto c = mTimeStep * area * (mGravity * heightDiff) / pipeLength;
+  ErodeWithStoredTilt(kC, kD, kE, heightAdder);
 
-    center[i] = std::max(0.0f, center[i] + c);
-  }
+  AdvectSediment();
+}
 
-  float totalOutputVolume =
-    std::accumulate(center.begin(), center.end(), 0.0f) * mTimeStep;
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Height,
+         typename CarryCapacity,
+         typename Deposition,
+         typename Erosion,
+         typename HeightAdder>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TransportSediment(
+  const Height& height,
+  CarryCapacity kC,
+  Deposition kD,
+  Erosion kE,
+  HeightAdder heightAdder)
+{
+  if (Config::RecomputeTilt)
+    ErodeWithRecomputedTilt(height, kC, kD, kE, heightAdder);
+  else
+    ErodeWithStoredTilt(kC, kD, kE, heightAdder);
 
-  if (totalOutputVolume > (centerW * mPipeLengths[0] * mPipeLengths[1])) {
+  AdvectSediment();
+}
 
-    auto k = GetScalingFactor(center, centerW);
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename CarryCapacity,
+         typename Deposition,
+         typename Erosion,
+         typename HeightAdder,
+         typename Tilt>
+bool
+BasicSimulation<Scalar, Storage, Allocator, Config>::ErodeAndDepositRow(
+  CarryCapacity& kC,
+  Deposition& kD,
+  Erosion& kE,
+  HeightAdder& heightAdder,
+  const Tilt* tilt,
+  int y)
+{
+  bool eroded = false;
+
+  int x = 0;
+
+#if TINYERODE_SIMD
+  x = ErodeAndDepositVectorized(
+    kC,
+    kD,
+    kE,
+    heightAdder,
+    tilt,
+    y,
+    eroded,
+    CanVectorizeErosion<CarryCapacity, Deposition, Erosion>());
+#endif
 
-    for (auto& n : center)
-      n *= k;
+  for (; x < GetWidth(); x++) {
+    if (ErodeAndDeposit(kC, kD, kE, heightAdder, Scalar(tilt[x]), x, y))
+      eroded = true;
   }
 
-  // Compute Tilt
+  return eroded;
+}
 
-  float avgDeltaY = 0;
-  avgDeltaY += (centerH - heightNeighbors[0]);
-  avgDeltaY += (heightNeighbors[3] - centerH);
-  avgDeltaY /= 2.0F * mPipeLengths[1];
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename CarryCapacity,
+         typename Deposition,
+         typename Erosion,
+         typename HeightAdder>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::ErodeWithStoredTilt(
+  CarryCapacity& kC,
+  Deposition& kD,
+  Erosion& kE,
+  HeightAdder& heightAdder)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
 
-  float avgDeltaX = 0;
-  avgDeltaX += (centerH - heightNeighbors[1]);
-  avgDeltaX += (heightNeighbors[2] - centerH);
-  avgDeltaX /= 2.0F * mPipeLengths[0];
+  for (int y = 0; y < GetHeight(); y++) {
 
-  float a = avgDeltaX * avgDeltaX;
-  float b = avgDeltaY * avgDeltaY;
-  auto tilt = sqrtf(a + b);
+    const Storage* tilt = mTilt.data() + ToIndex(0, y);
 
-  mTilt[ToIndex(x, y)] = tilt;
+    if (ErodeAndDepositRow(kC, kD, kE, heightAdder, tilt, y))
+      mDirtyRows[y] = 1;
+  }
 }
 
-template<typename CarryCapacity,
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Height,
+         typename CarryCapacity,
          typename Deposition,
          typename Erosion,
          typename HeightAdder>
 void
-Simulation::TransportSediment(CarryCapacity kC,
-                              Deposition kD,
-                              Erosion kE,
-                              HeightAdder heightAdder)
+BasicSimulation<Scalar, Storage, Allocator, Config>::ErodeWithRecomputedTilt(
+  const Height& height,
+  CarryCapacity& kC,
+  Deposition& kD,
+  Erosion& kE,
+  HeightAdder& heightAdder)
 {
+  // The tilt of a row depends on the rows above and below it, which have to be
+  // read before they are eroded. Within a band, the tilt of the next row is
+  // computed before the current row is eroded. The first and last row of each
+  // band read rows of the neighboring bands, so they are computed up front.
+
+  const int bandCount = GetBandCount();
+
 #ifdef _OPENMP
 #pragma omp parallel for
 #endif
 
-  for (int y = 0; y < GetHeight(); y++) {
-    for (int x = 0; x < GetWidth(); x++)
-      ErodeAndDeposit(kC, kD, kE, heightAdder, x, y);
-  }
+  for (int band = 0; band < bandCount; band++) {
+
+    const int firstY = band * BandSize;
+    const int lastY = std::min(firstY + BandSize, GetHeight()) - 1;
 
-  std::vector<float> nextSediment(GetWidth() * GetHeight());
+    ComputeTiltRow(height, firstY, GetTiltRow(band, 0));
+
+    ComputeTiltRow(height, lastY, GetTiltRow(band, 2));
+  }
 
 #ifdef _OPENMP
 #pragma omp parallel for
 #endif
 
-  for (int y = 0; y < GetHeight(); y++) {
+  for (int band = 0; band < bandCount; band++) {
 
-    for (int x = 0; x < GetWidth(); x++) {
+    const int firstY = band * BandSize;
+    const int lastY = std::min(firstY + BandSize, GetHeight()) - 1;
 
-      auto index = ToIndex(x, y);
+    for (int y = firstY; y <= lastY; y++) {
+
+      if ((y + 1) < lastY)
+        ComputeTiltRow(height, y + 1, GetTiltRow(band, (y + 1 - firstY) % 2));
+
+      const Scalar* tilt =
+        GetTiltRow(band, (y == lastY) ? 2 : ((y - firstY) % 2));
+
+      ErodeAndDepositRow(kC, kD, kE, heightAdder, tilt, y);
+    }
+  }
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::AdvectSediment()
+{
+  ForEachSpan(
+    [this](int y, int minX, int maxX) { AdvectSpan(y, minX, maxX); });
+
+  mSediment.swap(mNextSediment);
+}
 
-      auto vel = mVelocity[index];
-      auto xf = x - (vel[0] * mTimeStep / mPipeLengths[0]);
-      auto yf = y - (vel[1] * mTimeStep / mPipeLengths[1]);
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::AdvectSpan(
+  int y,
+  int minX,
+  int maxX) noexcept
+{
+  int x = minX;
+
+#if TINYERODE_SIMD
+  x = AdvectVectorized(y, minX, maxX, CanVectorizeCells());
+#endif
+
+  for (; x < maxX; x++)
+    AdvectAt(x, y);
+}
+
+#if TINYERODE_SIMD
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+int
+BasicSimulation<Scalar, Storage, Allocator, Config>::AdvectVectorized(
+  int y,
+  int minX,
+  int maxX,
+  std::true_type) noexcept
+{
+  AdvectionRow row;
+
+  row.sediment = mSediment.data() + ToIndex(0, 0);
+  row.velocity =
+    reinterpret_cast<const float*>(mVelocity.data() + ToIndex(0, y));
+  row.nextSediment = mNextSediment.data() + ToIndex(0, y);
+  row.y = y;
+  row.stride = GetStride();
+  row.minSample = std::array<int, 2>{ { -Halo, -Halo } };
+  row.maxSample = std::array<int, 2>{ { GetWidth() + Halo - 2,
+                                        GetHeight() + Halo - 2 } };
+  row.timeStep = mTimeStep;
+  row.pipeLengths = std::array<float, 2>{ { GetPipeLength(0),
+                                            GetPipeLength(1) } };
+
+  return RunKernel<AdvectionKernel>(mInstructionSet, row, minX, maxX);
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename CarryCapacity,
+         typename Deposition,
+         typename Erosion,
+         typename HeightAdder>
+int
+BasicSimulation<Scalar, Storage, Allocator, Config>::ErodeAndDepositVectorized(
+  CarryCapacity& kC,
+  Deposition& kD,
+  Erosion& kE,
+  HeightAdder& heightAdder,
+  const float* tilt,
+  int y,
+  bool& eroded,
+  std::true_type)
+{
+  ErosionRow row;
 
-      auto xfi = int(xf);
-      auto yfi = int(yf);
+  row.carryCapacity = Scalar(Evaluate(kC, 0, y));
+  row.deposition = Scalar(Evaluate(kD, 0, y));
+  row.erosion = Scalar(Evaluate(kE, 0, y));
+  row.minTilt = GetMinTilt();
 
-      auto u = xf - xfi;
-      auto v = yf - yfi;
+  float heightDelta[ErosionBatchSize];
 
-      std::array<float, 4> s{ { 0, 0, 0, 0 } };
+  for (int minX = 0; minX < GetWidth(); minX += ErosionBatchSize) {
 
-      if (InBounds(xfi + 0, yfi + 0))
-        s[0] = mSediment[ToIndex(xfi + 0, yfi + 0)];
+    const int count = std::min(GetWidth() - minX, int(ErosionBatchSize));
 
-      if (InBounds(xfi + 1, yfi + 0))
-        s[1] = mSediment[ToIndex(xfi + 1, yfi + 0)];
+    row.tilt = tilt + minX;
+    row.velocity =
+      reinterpret_cast<const float*>(mVelocity.data() + ToIndex(minX, y));
+    row.sediment = mSediment.data() + ToIndex(minX, y);
+    row.heightDelta = heightDelta;
 
-      if (InBounds(xfi + 0, yfi + 1))
-        s[2] = mSediment[ToIndex(xfi + 0, yfi + 1)];
+    RunKernel<ErosionKernel>(mInstructionSet, row, 0, count);
 
-      if (InBounds(xfi + 1, yfi + 1))
-        s[3] = mSediment[ToIndex(xfi + 1, yfi + 1)];
+    for (int i = 0; i < count; i++) {
 
-      float sx1 = s[0] + (u * (s[1] - s[0]));
-      float sx2 = s[2] + (u * (s[3] - s[2]));
+      heightAdder(minX + i, y, heightDelta[i]);
 
-      nextSediment[index] = sx1 + (v * (sx2 - sx1));
+      if (heightDelta[i] != 0.0f)
+        eroded = true;
     }
   }
 
-  mSediment = std::move(nextSediment);
+  return GetWidth();
+}
+
+#endif
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::AdvectAt(int x,
+                                                              int y) noexcept
+{
+  auto index = ToIndex(x, y);
+
+  auto vel = LoadVelocity(index);
+
+  int xfi;
+  int yfi;
+
+  Scalar u;
+  Scalar v;
+
+  // Samples that are entirely outside of the grid are moved into the halo,
+  // where they read zero just like before they were moved.
+  AdvectionKernel::FindSource<Serial>(GetAdvectionConstants(),
+                                      Serial::ToFloat(x),
+                                      Serial::ToFloat(y),
+                                      vel[0],
+                                      vel[1],
+                                      xfi,
+                                      yfi,
+                                      u,
+                                      v);
+
+  std::array<Scalar, 4> s{ {
+    Scalar(mSediment[ToIndex(xfi + 0, yfi + 0)]),
+    Scalar(mSediment[ToIndex(xfi + 1, yfi + 0)]),
+    Scalar(mSediment[ToIndex(xfi + 0, yfi + 1)]),
+    Scalar(mSediment[ToIndex(xfi + 1, yfi + 1)]),
+  } };
+
+  Scalar sediment;
+
+  AdvectionKernel::Interpolate<Serial>(u, v, s.data(), sediment);
+
+  mNextSediment[index] = Storage(sediment);
 }
 
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
 template<typename HeightAdder>
 void
-Simulation::TerminateRainfall(HeightAdder heightAdder)
+BasicSimulation<Scalar, Storage, Allocator, Config>::TerminateRainfall(
+  HeightAdder heightAdder)
 {
 #ifdef _OPENMP
 #pragma omp parallel for
@@ -416,54 +4094,95 @@ Simulation::TerminateRainfall(HeightAdder heightAdder)
 
   for (int y = 0; y < GetHeight(); y++) {
 
+    bool deposited = false;
+
     for (int x = 0; x < GetWidth(); x++) {
 
       auto index = ToIndex(x, y);
 
-      float sediment = mSediment[index];
+      Scalar sediment = Scalar(mSediment[index]);
 
-      heightAdder(x, y, sediment / (mPipeLengths[0] * mPipeLengths[1]));
+      heightAdder(x, y, sediment / (GetPipeLength(0) * GetPipeLength(1)));
 
-      mSediment[index] = 0;
+      if (sediment != Scalar(0))
+        deposited = true;
 
-      mVelocity[index][0] = 0;
-      mVelocity[index][1] = 0;
+      mSediment[index] = Storage(0);
+
+      mVelocity[index] = StoredVelocity{ { Storage(0), Storage(0) } };
     }
+
+    if (!Config::RecomputeTilt && deposited)
+      mDirtyRows[y] = 1;
   }
 }
 
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::TerminateRainfall(
+  BasicTerrain<Scalar>& terrain)
+{
+  TerminateRainfall([&terrain](int x, int y, Scalar heightDelta) {
+    terrain.AddHeight(x, y, heightDelta);
+  });
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
 template<typename CarryCapacity,
          typename Deposition,
          typename Erosion,
          typename HeightAdder>
-void
-Simulation::ErodeAndDeposit(CarryCapacity& kC,
-                            Deposition& kD,
-                            Erosion& kE,
-                            HeightAdder& heightAdder,
-                            int x,
-                            int y)
+bool
+BasicSimulation<Scalar, Storage, Allocator, Config>::ErodeAndDeposit(
+  CarryCapacity& kC,
+  Deposition& kD,
+  Erosion& kE,
+  HeightAdder& heightAdder,
+  Scalar tilt,
+  int x,
+  int y)
 {
-  auto vel = mVelocity[ToIndex(x, y)];
+  auto vel = LoadVelocity(ToIndex(x, y));
+
+  Scalar capacity;
+
+  ErosionKernel::ComputeCapacity<Serial>(
+    Scalar(Evaluate(kC, x, y)), GetMinTilt(), tilt, vel[0], vel[1], capacity);
 
-  auto velocityMagnitude = std::sqrt((vel[0] * vel[0]) + (vel[1] * vel[1]));
+  Scalar sediment = Scalar(mSediment[ToIndex(x, y)]);
 
-  float tiltAngle = mTilt[ToIndex(x, y)];
+  // Only the constant that is used is evaluated.
+  Scalar factor = (capacity > sediment) ? Scalar(Evaluate(kE, x, y))
+                                        : Scalar(Evaluate(kD, x, y));
 
-  float capacity = kC(x, y) * std::max(mMinTilt, tiltAngle) * velocityMagnitude;
+  Scalar heightDelta;
+  Scalar nextSediment;
 
-  float sediment = mSediment[ToIndex(x, y)];
+  ErosionKernel::Transfer<Serial>(
+    factor, capacity, sediment, heightDelta, nextSediment);
 
-  float factor = (capacity > sediment) ? kE(x, y) : kD(x, y);
+  heightAdder(x, y, heightDelta);
 
-  heightAdder(x, y, -(factor * (capacity - sediment)));
+  mSediment[ToIndex(x, y)] = Storage(nextSediment);
 
-  mSediment[ToIndex(x, y)] += factor * (capacity - sediment);
+  return heightDelta != Scalar(0);
 }
 
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
 template<typename WaterAdder, typename Evaporation>
 void
-Simulation::Evaporate(WaterAdder water, Evaporation kEvap)
+BasicSimulation<Scalar, Storage, Allocator, Config>::Evaporate(
+  WaterAdder water,
+  Evaporation kEvap)
 {
 #ifdef _OPENMP
 #pragma omp parallel for
@@ -471,44 +4190,172 @@ Simulation::Evaporate(WaterAdder water, Evaporation kEvap)
 
   for (int y = 0; y < GetHeight(); y++) {
     for (int x = 0; x < GetWidth(); x++)
-      water(x, y, -mTimeStep * kEvap(x, y));
+      water(x, y, GetEvaporation(kEvap, x, y));
   }
 }
 
-inline auto
-Simulation::GetInflow(int centerX, int centerY) const noexcept -> Flow
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+Scalar
+BasicSimulation<Scalar, Storage, Allocator, Config>::ComputeFlux(
+  Scalar flux,
+  Scalar centerH,
+  Scalar centerW,
+  Scalar neighborH,
+  Scalar neighborW,
+  Scalar pipeLength) const noexcept
+{
+  auto heightDiff = (centerH + centerW) - (neighborH + neighborW);
+
+  // Cross sectional area of the virtual pipe.
+  Scalar area = GetPipeArea();
+
+  auto c = mTimeStep * area * (GetGravity() * heightDiff) / pipeLength;
+
+  // A cell has four pipes, so limiting each pipe to a quarter of the water in
+  // the cell it drains keeps the water level from becoming negative.
+  Scalar volumeToFlux = (GetPipeLength(0) * GetPipeLength(1)) / (4 * mTimeStep);
+
+  Scalar maxFlux = centerW * volumeToFlux;
+  Scalar minFlux = -neighborW * volumeToFlux;
+
+  return std::min(maxFlux, std::max(minFlux, flux + c));
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+auto
+BasicSimulation<Scalar, Storage, Allocator, Config>::LoadFlow(
+  int index) const noexcept
+  -> Flow
+{
+  return Flow{ { GetFlow(index, 0),
+                 GetFlow(index, 1),
+                 GetFlow(index, 2),
+                 GetFlow(index, 3) } };
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::StoreFlow(
+  int index,
+  const Flow& flow) noexcept
+{
+  for (int i = 0; i < 4; i++)
+    GetStoredFlow(index, i) = Storage(flow[i]);
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+auto
+BasicSimulation<Scalar, Storage, Allocator, Config>::GetInflow(
+  int centerX,
+  int centerY) const noexcept -> Flow
 {
   std::array<int, 4> xDeltas{ { 0, -1, 1, 0 } };
   std::array<int, 4> yDeltas{ { -1, 0, 0, 1 } };
 
-  std::array<float, 4> inflow{ { 0, 0, 0, 0 } };
+  Flow inflow;
 
   for (int i = 0; i < 4; i++) {
 
     int x = centerX + xDeltas[i];
     int y = centerY + yDeltas[i];
 
-    if (InBounds(x, y))
-      inflow[i] = GetFlow(x, y)[3 - i];
+    inflow[i] = GetFlow(ToIndex(x, y), 3 - i);
   }
 
   return inflow;
 }
 
-inline float
-Simulation::GetScalingFactor(const Flow& flow, float waterLevel) noexcept
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename Kernel>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::ForEachSpan(
+  const Kernel& kernel)
+{
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+
+  for (int y = 0; y < GetHeight(); y++)
+    kernel(y, 0, GetWidth());
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+template<typename T>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::Fill(Vector<T>& values,
+                                                          const T& value)
+{
+  const int count = int(values.size());
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+
+  for (int i = 0; i < count; i++)
+    values[i] = value;
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::Reset()
+{
+  const Storage zero(0);
+
+  Fill(mFlow, zero);
+
+  Fill(mSediment, zero);
+
+  Fill(mVelocity, StoredVelocity{ { zero, zero } });
+
+  Fill(mTilt, zero);
+
+  InvalidateTilt();
+}
+
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+std::vector<Scalar>
+BasicSimulation<Scalar, Storage, Allocator, Config>::GetSediment() const
 {
-  auto volume = std::accumulate(flow.begin(), flow.end(), 0.0f) * mTimeStep;
+  std::vector<Scalar> sediment(GetWidth() * GetHeight());
 
-  if (volume == 0.0f)
-    return 1.0f;
+  for (int y = 0; y < GetHeight(); y++) {
+    for (int x = 0; x < GetWidth(); x++)
+      sediment[(y * GetWidth()) + x] = Scalar(mSediment[ToIndex(x, y)]);
+  }
 
-  return std::min(1.0f,
-                  (waterLevel * mPipeLengths[0] * mPipeLengths[1]) / volume);
+  return sediment;
 }
 
-inline void
-Simulation::Resize(int w, int h)
+template<typename Scalar,
+         typename Storage,
+         typename Allocator,
+         typename Config>
+void
+BasicSimulation<Scalar, Storage, Allocator, Config>::Resize(int w, int h)
 {
   assert(w >= 0);
   assert(h >= 0);
@@ -516,16 +4363,30 @@ Simulation::Resize(int w, int h)
   w = std::max(w, 0);
   h = std::max(h, 0);
 
-  mFlow.resize(w * h);
+  mSize[0] = w;
+  mSize[1] = h;
+
+  const int cellCount = GetStride() * (h + (Halo * 2));
 
-  mSediment.resize(w * h);
+  mCellCount = cellCount;
 
-  mVelocity.resize(w * h);
+  const Storage zero(0);
 
-  mTilt.resize(w * h);
+  mFlow.assign(FlowPlaneCount * cellCount, zero);
 
-  mSize[0] = w;
-  mSize[1] = h;
+  mSediment.assign(cellCount, zero);
+
+  mNextSediment.assign(cellCount, zero);
+
+  mVelocity.assign(cellCount, StoredVelocity{ { zero, zero } });
+
+  if (Config::RecomputeTilt) {
+    mTiltRows.assign(GetBandCount() * 3 * w, Scalar(0));
+  } else {
+    mTilt.assign(cellCount, zero);
+
+    mDirtyRows.assign(h, 1);
+  }
 }
 
 } // namespace TinyErode
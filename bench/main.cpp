@@ -0,0 +1,705 @@
+#include <TinyErode.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef ERODE_BENCH_FLOW_MODEL
+#define ERODE_BENCH_FLOW_MODEL Outflow
+#endif
+
+#ifndef ERODE_BENCH_FLOW_LAYOUT
+#define ERODE_BENCH_FLOW_LAYOUT SOA
+#endif
+
+#ifndef ERODE_BENCH_RECOMPUTE_TILT
+#define ERODE_BENCH_RECOMPUTE_TILT 0
+#endif
+
+namespace {
+
+/// The configuration of every simulation in this benchmark program. The flow
+/// model, the flow layout and whether the tilt is recomputed are selected by
+/// the build, which makes one program for each variant.
+struct BenchConfig : TinyErode::DynamicConfig
+{
+  static constexpr TinyErode::FlowModel Model =
+    TinyErode::FlowModel::ERODE_BENCH_FLOW_MODEL;
+
+  static constexpr TinyErode::FlowLayout Layout =
+    TinyErode::FlowLayout::ERODE_BENCH_FLOW_LAYOUT;
+
+  static constexpr bool RecomputeTilt = ERODE_BENCH_RECOMPUTE_TILT != 0;
+};
+
+struct Options final
+{
+  int steps = 8;
+
+  float timeStep = 0.1f;
+
+  bool aligned = false;
+
+  /// Whether to run each iteration with a single call to Step.
+  bool fused = false;
+
+  /// Whether to evaporate water while it is transported.
+  bool foldEvaporation = false;
+
+  /// Whether to only recompute the tilt of rows that have been eroded.
+  bool incrementalTilt = false;
+
+  /// Whether to only rain on a square in the middle of the terrain, so that
+  /// the rows above and below it stay dry and are not eroded.
+  bool localRain = false;
+
+  /// Whether to pass the height and water models with row access, instead of
+  /// as lambdas.
+  bool rowAccess = false;
+
+  /// Whether to run each iteration with a call to Step on a terrain, instead
+  /// of through callbacks.
+  bool terrain = false;
+
+  /// The instruction set of the vectorized kernels, or "auto" to use the widest
+  /// one that is supported.
+  std::string isa = "auto";
+
+  std::string scalar = "float";
+
+  std::string storage = "float";
+
+  /// Whether to pass the carry capacity, deposition, erosion and evaporation
+  /// as double precision uniforms, instead of single precision numbers.
+  bool doubleUniforms = false;
+
+  /// Whether to fail unless the height map is the same as that of the
+  /// reference run, to within the maximum error.
+  bool check = false;
+
+  /// The largest difference in height from the reference run that the check
+  /// accepts. It is zero unless the options give different results on purpose.
+  float maxError = 0;
+};
+
+struct Result final
+{
+  double secondsPerStep = 0;
+
+  /// Whether the simulation erodes with the vectorized kernels when passed the
+  /// parameters of this run.
+  bool vectorizedErosion = false;
+
+  std::vector<float> initialHeightMap;
+
+  std::vector<float> heightMap;
+};
+
+const char*
+GetFlowModelName(TinyErode::FlowModel model)
+{
+  switch (model) {
+    case TinyErode::FlowModel::Outflow:
+      return "outflow";
+    case TinyErode::FlowModel::NetFlux:
+      return "net flux";
+  }
+
+  return "unknown";
+}
+
+const char*
+GetFlowLayoutName()
+{
+  if (BenchConfig::Model == TinyErode::FlowModel::NetFlux)
+    return "staggered";
+
+  switch (BenchConfig::Layout) {
+    case TinyErode::FlowLayout::AOS:
+      return "aos";
+    case TinyErode::FlowLayout::SOA:
+      return "soa";
+  }
+
+  return "unknown";
+}
+
+const char*
+GetTiltModeName()
+{
+  return BenchConfig::RecomputeTilt ? "recomputed" : "stored";
+}
+
+template<typename Rng>
+void
+GenHeightMap(int w, int h, std::vector<float>& heightMap, Rng& rng)
+{
+  std::uniform_real_distribution<float> noiseDist(0, 1);
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+
+      float u = (x + 0.5f) / w;
+      float v = (y + 0.5f) / h;
+
+      heightMap[(y * w) + x] =
+        std::sin(v * M_PI) * std::sin(u * M_PI) * 50.0f + noiseDist(rng);
+    }
+  }
+}
+
+/// Gets the name of the instruction set that the vectorized kernels run with,
+/// which can be narrower than the requested one if the CPU does not support it.
+const char*
+GetInstructionSetName(const Options& options)
+{
+  TinyErode::InstructionSet isa = TinyErode::GetSupportedInstructionSet();
+
+  if (options.isa == "scalar")
+    isa = TinyErode::InstructionSet::Scalar;
+  else if ((options.isa == "sse2") && (isa > TinyErode::InstructionSet::SSE2))
+    isa = TinyErode::InstructionSet::SSE2;
+  else if ((options.isa == "avx2") && (isa > TinyErode::InstructionSet::AVX2))
+    isa = TinyErode::InstructionSet::AVX2;
+
+  switch (isa) {
+    case TinyErode::InstructionSet::AVX512:
+      return "avx512";
+    case TinyErode::InstructionSet::AVX2:
+      return "avx2";
+    case TinyErode::InstructionSet::SSE2:
+      return "sse2";
+    case TinyErode::InstructionSet::Scalar:
+      break;
+  }
+
+  return "scalar";
+}
+
+/// Reads a row major grid, exposing its rows to the simulation.
+struct GridRows final
+{
+  const float* data;
+
+  int w;
+
+  float operator()(int x, int y) const { return data[(y * w) + x]; }
+
+  const float* row(int y) const { return data + (y * w); }
+};
+
+/// Runs a single iteration of the simulation, in the way selected by the
+/// options.
+template<typename SimulationType,
+         typename Height,
+         typename Water,
+         typename WaterAdder,
+         typename HeightAdder,
+         typename Parameter>
+void
+RunIteration(SimulationType& simulation,
+             const Options& options,
+             const Height& getHeight,
+             const Water& getWater,
+             WaterAdder& addWater,
+             Parameter carryCapacity,
+             Parameter deposition,
+             Parameter erosion,
+             HeightAdder& addHeight,
+             Parameter evaporation)
+{
+  if (options.fused) {
+    simulation.Step(getHeight,
+                    getWater,
+                    addWater,
+                    carryCapacity,
+                    deposition,
+                    erosion,
+                    addHeight,
+                    evaporation);
+    return;
+  }
+
+  simulation.ComputeFlowAndTilt(getHeight, getWater);
+
+  if (options.foldEvaporation) {
+    simulation.TransportWater(addWater, evaporation);
+  } else {
+    simulation.TransportWater(addWater);
+  }
+
+  simulation.TransportSediment(
+    getHeight, carryCapacity, deposition, erosion, addHeight);
+
+  if (!options.foldEvaporation)
+    simulation.Evaporate(addWater, evaporation);
+}
+
+/// Runs all of the iterations, reading the height and water models with the
+/// accessors passed to this.
+template<typename SimulationType,
+         typename Height,
+         typename Water,
+         typename WaterAdder,
+         typename HeightAdder,
+         typename Parameter>
+void
+RunIterations(SimulationType& simulation,
+              const Options& options,
+              const Height& getHeight,
+              const Water& getWater,
+              WaterAdder& addWater,
+              Parameter carryCapacity,
+              Parameter deposition,
+              Parameter erosion,
+              HeightAdder& addHeight,
+              Parameter evaporation)
+{
+  for (int i = 0; i < options.steps; i++) {
+    RunIteration(simulation,
+                 options,
+                 getHeight,
+                 getWater,
+                 addWater,
+                 carryCapacity,
+                 deposition,
+                 erosion,
+                 addHeight,
+                 evaporation);
+  }
+}
+
+/// Runs the iterations on the height and water maps, in the way selected by
+/// the options, and terminates the rainfall afterwards.
+///
+/// @return The number of seconds spent per iteration.
+template<typename SimulationType, typename Parameter>
+double
+RunSimulation(SimulationType& simulation,
+              const Options& options,
+              std::vector<float>& heightMap,
+              std::vector<float>& water,
+              Parameter carryCapacity,
+              Parameter deposition,
+              Parameter erosion,
+              Parameter evaporation)
+{
+  const int w = simulation.GetWidth();
+  const int h = simulation.GetHeight();
+
+  if (options.terrain) {
+
+    using ScalarType = decltype(simulation.GetTimeStep());
+
+    TinyErode::BasicTerrain<ScalarType> terrain(w, h);
+
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        terrain.GetHeightMap()(x, y) = heightMap[(y * w) + x];
+        terrain.GetWaterMap()(x, y) = water[(y * w) + x];
+      }
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (int i = 0; i < options.steps; i++)
+      simulation.Step(terrain, carryCapacity, deposition, erosion, evaporation);
+
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    simulation.TerminateRainfall(terrain);
+
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++)
+        heightMap[(y * w) + x] = terrain.GetHeightMap()(x, y);
+    }
+
+    return std::chrono::duration<double>(stop - start).count() / options.steps;
+  }
+
+  auto getHeight = [&heightMap, w](int x, int y) {
+    return heightMap[(y * w) + x];
+  };
+
+  auto getWater = [&water, w](int x, int y) { return water[(y * w) + x]; };
+
+  auto addWater = [&water, w](int x, int y, float waterDelta) -> float {
+    return water[(y * w) + x] = std::max(0.0f, water[(y * w) + x] + waterDelta);
+  };
+
+  auto addHeight = [&heightMap, w](int x, int y, float deltaHeight) {
+    heightMap[(y * w) + x] += deltaHeight;
+  };
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  if (options.rowAccess) {
+    RunIterations(simulation,
+                  options,
+                  GridRows{ heightMap.data(), w },
+                  GridRows{ water.data(), w },
+                  addWater,
+                  carryCapacity,
+                  deposition,
+                  erosion,
+                  addHeight,
+                  evaporation);
+  } else {
+    RunIterations(simulation,
+                  options,
+                  getHeight,
+                  getWater,
+                  addWater,
+                  carryCapacity,
+                  deposition,
+                  erosion,
+                  addHeight,
+                  evaporation);
+  }
+
+  auto stop = std::chrono::high_resolution_clock::now();
+
+  simulation.TerminateRainfall(addHeight);
+
+  return std::chrono::duration<double>(stop - start).count() / options.steps;
+}
+
+/// Runs a number of iterations on a square terrain, measuring the number of
+/// seconds spent per iteration.
+template<typename SimulationType>
+Result
+RunBenchmark(int size, const Options& options)
+{
+  const int w = size;
+  const int h = size;
+
+  std::seed_seq seed{ 1234, 42, 4321 };
+
+  std::mt19937 rng(seed);
+
+  std::vector<float> heightMap(w * h);
+
+  GenHeightMap(w, h, heightMap, rng);
+
+  std::vector<float> water(w * h, 0.1f);
+
+  if (options.localRain) {
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        const bool inside = (x >= (w / 4)) && (x < ((w * 3) / 4)) &&
+                            (y >= (h / 4)) && (y < ((h * 3) / 4));
+        if (!inside)
+          water[(y * w) + x] = 0;
+      }
+    }
+  }
+
+  const float carryCapacity = 0.01f;
+
+  const float deposition = 0.1f;
+
+  const float erosion = 0.1f;
+
+  const float evaporation = 0.01f;
+
+  SimulationType simulation(w, h);
+
+  if (options.isa == "scalar")
+    simulation.SetInstructionSet(TinyErode::InstructionSet::Scalar);
+  else if (options.isa == "sse2")
+    simulation.SetInstructionSet(TinyErode::InstructionSet::SSE2);
+  else if (options.isa == "avx2")
+    simulation.SetInstructionSet(TinyErode::InstructionSet::AVX2);
+
+  simulation.SetIncrementalTilt(options.incrementalTilt);
+
+  simulation.SetTimeStep(options.timeStep);
+  simulation.SetMetersPerX(1000.0f / w);
+  simulation.SetMetersPerY(1000.0f / h);
+
+  Result result;
+
+  result.initialHeightMap = heightMap;
+
+  if (options.doubleUniforms) {
+
+    using DoubleUniform = TinyErode::Uniform<double>;
+
+    result.vectorizedErosion =
+      SimulationType::template IsErosionVectorized<DoubleUniform,
+                                                   DoubleUniform,
+                                                   DoubleUniform>();
+
+    result.secondsPerStep = RunSimulation(simulation,
+                                          options,
+                                          heightMap,
+                                          water,
+                                          DoubleUniform(carryCapacity),
+                                          DoubleUniform(deposition),
+                                          DoubleUniform(erosion),
+                                          DoubleUniform(evaporation));
+  } else {
+    result.vectorizedErosion =
+      SimulationType::template IsErosionVectorized<float, float, float>();
+
+    result.secondsPerStep = RunSimulation(simulation,
+                                          options,
+                                          heightMap,
+                                          water,
+                                          carryCapacity,
+                                          deposition,
+                                          erosion,
+                                          evaporation);
+  }
+
+  result.heightMap = std::move(heightMap);
+
+  return result;
+}
+
+template<typename Scalar, typename Storage>
+Result
+RunBenchmarkWithTypes(int size, const Options& options)
+{
+  using namespace TinyErode;
+
+  using AlignedSimulation =
+    BasicSimulation<Scalar, Storage, AlignedAllocator<Storage>, BenchConfig>;
+
+  using Simulation =
+    BasicSimulation<Scalar, Storage, std::allocator<Storage>, BenchConfig>;
+
+  if (options.aligned)
+    return RunBenchmark<AlignedSimulation>(size, options);
+
+  return RunBenchmark<Simulation>(size, options);
+}
+
+template<typename Scalar>
+bool
+RunBenchmarkWithScalar(int size, const Options& options, Result& result)
+{
+  if (options.storage == "float") {
+    result = RunBenchmarkWithTypes<Scalar, float>(size, options);
+  } else if (options.storage == "double") {
+    result = RunBenchmarkWithTypes<Scalar, double>(size, options);
+  } else if (options.storage == "half") {
+    result = RunBenchmarkWithTypes<Scalar, TinyErode::Half>(size, options);
+  } else if (options.storage == "bfloat16") {
+    result = RunBenchmarkWithTypes<Scalar, TinyErode::BFloat16>(size, options);
+  } else {
+    std::cerr << "Unknown storage '" << options.storage << "'" << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+/// Prints how far the height map of a result is from a reference run, relative
+/// to how much the terrain was eroded.
+///
+/// @return The largest difference in height.
+double
+PrintAccuracy(const Result& result, const Result& reference)
+{
+  double maxError = 0;
+  double totalError = 0;
+  double totalErosion = 0;
+
+  for (size_t i = 0; i < reference.heightMap.size(); i++) {
+
+    double error = std::abs(result.heightMap[i] - reference.heightMap[i]);
+
+    maxError = std::max(maxError, error);
+
+    totalError += error;
+
+    totalErosion +=
+      std::abs(reference.heightMap[i] - reference.initialHeightMap[i]);
+  }
+
+  std::cout << "  max height error: " << maxError
+            << ", mean height error: " << totalError / totalErosion
+            << " of mean height change" << std::endl;
+
+  return maxError;
+}
+
+bool
+ParseIntOpt(const char* name, const char* arg1, const char* arg2, int* value)
+{
+  if (strcmp(name, arg1) != 0)
+    return false;
+
+  return arg2 && (sscanf(arg2, "%d", value) == 1);
+}
+
+bool
+ParseFloatOpt(const char* name,
+              const char* arg1,
+              const char* arg2,
+              float* value)
+{
+  if (strcmp(name, arg1) != 0)
+    return false;
+
+  return arg2 && (sscanf(arg2, "%f", value) == 1);
+}
+
+} // namespace
+
+int
+main(int argc, char** argv)
+{
+  std::vector<int> sizes;
+
+  Options options;
+
+  for (int i = 1; i < argc; i++) {
+
+    int size = 0;
+
+    if (ParseIntOpt("--size", argv[i], argv[i + 1], &size)) {
+      sizes.push_back(size);
+      i++;
+    } else if (ParseIntOpt("--steps", argv[i], argv[i + 1], &options.steps)) {
+      i++;
+    } else if (ParseFloatOpt(
+                 "--time-step", argv[i], argv[i + 1], &options.timeStep)) {
+      i++;
+    } else if (ParseFloatOpt(
+                 "--max-error", argv[i], argv[i + 1], &options.maxError)) {
+      i++;
+    } else if (strcmp(argv[i], "--aligned") == 0) {
+      options.aligned = true;
+    } else if (strcmp(argv[i], "--fused") == 0) {
+      options.fused = true;
+    } else if (strcmp(argv[i], "--fold-evaporation") == 0) {
+      options.foldEvaporation = true;
+    } else if (strcmp(argv[i], "--terrain") == 0) {
+      options.terrain = true;
+    } else if (strcmp(argv[i], "--row-access") == 0) {
+      options.rowAccess = true;
+    } else if (strcmp(argv[i], "--incremental-tilt") == 0) {
+      if (BenchConfig::RecomputeTilt) {
+        std::cerr << "Incremental tilt requires the tilt to be stored"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      options.incrementalTilt = true;
+    } else if (strcmp(argv[i], "--local-rain") == 0) {
+      options.localRain = true;
+    } else if ((strcmp(argv[i], "--isa") == 0) && argv[i + 1]) {
+      options.isa = argv[i + 1];
+      if ((options.isa != "auto") && (options.isa != "scalar") &&
+          (options.isa != "sse2") && (options.isa != "avx2") &&
+          (options.isa != "avx512")) {
+        std::cerr << "Unknown instruction set '" << options.isa << "'"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      i++;
+    } else if ((strcmp(argv[i], "--scalar") == 0) && argv[i + 1]) {
+      options.scalar = argv[i + 1];
+      i++;
+    } else if ((strcmp(argv[i], "--storage") == 0) && argv[i + 1]) {
+      options.storage = argv[i + 1];
+      i++;
+    } else if (strcmp(argv[i], "--double-uniforms") == 0) {
+      options.doubleUniforms = true;
+    } else if (strcmp(argv[i], "--check") == 0) {
+      options.check = true;
+    } else {
+      std::cerr << "Unknown option '" << argv[i] << "'" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (sizes.empty())
+    sizes = { 4096, 8192 };
+
+  for (auto size : sizes) {
+
+    Result result;
+
+    bool ok = false;
+
+    if (options.scalar == "float") {
+      ok = RunBenchmarkWithScalar<float>(size, options, result);
+    } else if (options.scalar == "double") {
+      ok = RunBenchmarkWithScalar<double>(size, options, result);
+    } else {
+      std::cerr << "Unknown scalar '" << options.scalar << "'" << std::endl;
+    }
+
+    if (!ok)
+      return EXIT_FAILURE;
+
+    double cellsPerSecond =
+      (double(size) * double(size)) / result.secondsPerStep;
+
+    std::cout << "flow model: " << GetFlowModelName(BenchConfig::Model)
+              << ", flow layout: " << GetFlowLayoutName()
+              << ", tilt: " << GetTiltModeName()
+              << ", fused: " << (options.fused ? "yes" : "no")
+              << ", evaporation: "
+              << (options.foldEvaporation ? "folded" : "separate")
+              << ", incremental tilt: "
+              << (options.incrementalTilt ? "yes" : "no")
+              << ", rain: " << (options.localRain ? "local" : "everywhere")
+              << ", row access: " << (options.rowAccess ? "yes" : "no")
+              << ", terrain: " << (options.terrain ? "yes" : "no")
+              << ", isa: " << options.isa << " ("
+              << GetInstructionSetName(options) << ")"
+              << ", scalar: " << options.scalar
+              << ", storage: " << options.storage
+              << ", uniforms: " << (options.doubleUniforms ? "double" : "float")
+              << ", allocator: " << (options.aligned ? "aligned" : "default")
+              << ", size: " << size << "x" << size
+              << ", seconds per step: " << result.secondsPerStep
+              << ", cells per second: " << cellsPerSecond << std::endl;
+
+    // Anything other than the default configuration is compared against it.
+
+    Options referenceOptions = options;
+    referenceOptions.fused = false;
+    referenceOptions.foldEvaporation = false;
+    referenceOptions.incrementalTilt = false;
+    referenceOptions.rowAccess = false;
+    referenceOptions.terrain = false;
+    referenceOptions.isa = "scalar";
+    referenceOptions.doubleUniforms = false;
+
+    if ((options.scalar != "float") || (options.storage != "float") ||
+        options.fused || options.foldEvaporation || options.incrementalTilt ||
+        options.rowAccess || options.terrain || (options.isa != "auto") ||
+        options.doubleUniforms || options.check) {
+      auto reference =
+        RunBenchmarkWithTypes<float, float>(size, referenceOptions);
+
+      const double maxError = PrintAccuracy(result, reference);
+
+      if (options.check && (maxError > options.maxError)) {
+        std::cerr << "The height map differs from the reference run"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+
+      if (options.check &&
+          (result.vectorizedErosion != reference.vectorizedErosion)) {
+        std::cerr << "The uniforms change whether the erosion is vectorized"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
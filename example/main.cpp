@@ -109,12 +109,18 @@ main()
 
   int rainfalls = 4;
 
+  TinyErode::Simulation simulation(w, h);
+
+  simulation.SetTimeStep(0.1F);
+  simulation.SetMetersPerX(metersPerX);
+  simulation.SetMetersPerY(metersPerY);
+
   for (int j = 0; j < rainfalls; j++) {
 
     std::cout << "Simulating rainfall " << j << " of " << rainfalls
               << std::endl;
 
-    TinyErode::Simulation simulation(w, h);
+    simulation.Reset();
 
     std::transform(
       water.begin(),
@@ -122,10 +128,6 @@ main()
       water.begin(),
       [&rng, &waterDist](float) -> float { return waterDist(rng); });
 
-    simulation.SetTimeStep(0.1F);
-    simulation.SetMetersPerX(metersPerX);
-    simulation.SetMetersPerY(metersPerY);
-
     for (int i = 0; i < iterations; i++) {
 
       simulation.ComputeFlowAndTilt(getHeight, getWater);
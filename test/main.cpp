@@ -102,6 +102,37 @@ ParseFloatOpt(const char* name,
   return sscanf(arg2, "%f", value) == 1;
 }
 
+/// Runs one iteration of the simulation, with either the functions or the
+/// uniform values for the constants.
+template<typename Height,
+         typename Water,
+         typename WaterAdder,
+         typename HeightAdder,
+         typename CarryCapacity,
+         typename Deposition,
+         typename Erosion,
+         typename Evaporation>
+void
+Iterate(TinyErode::Simulation& simulation,
+        const Height& getHeight,
+        const Water& getWater,
+        const WaterAdder& addWater,
+        const HeightAdder& addHeight,
+        CarryCapacity carryCapacity,
+        Deposition deposition,
+        Erosion erosion,
+        Evaporation evaporation)
+{
+  simulation.ComputeFlowAndTilt(getHeight, getWater);
+
+  simulation.TransportWater(addWater);
+
+  simulation.TransportSediment(
+    getHeight, carryCapacity, deposition, erosion, addHeight);
+
+  simulation.Evaporate(addWater, evaporation);
+}
+
 int
 main(int argc, char** argv)
 {
@@ -130,11 +161,15 @@ main(int argc, char** argv)
 
   int rainfalls = 5;
 
+  bool uniform = false;
+
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--log-water") == 0) {
       Debugger::GetInstance().EnableWaterLog();
     } else if (strcmp(argv[i], "--log-sediment") == 0) {
       Debugger::GetInstance().EnableSedimentLog();
+    } else if (strcmp(argv[i], "--uniform") == 0) {
+      uniform = true;
     } else if (ParseFloatOpt("--height-range",
                              argv[i],
                              argv[i + 1],
@@ -227,14 +262,27 @@ main(int argc, char** argv)
 
   auto evaporation = [kEvaporation](int, int) -> float { return kEvaporation; };
 
-  for (int i = 0; i < rainfalls; i++) {
+  // The same constants, but known to be uniform at compile time, which lets
+  // the simulation read them once instead of calling a function for each cell.
+
+  TinyErode::Uniform<float> uniformCarryCapacity(kCapacity);
 
-    TinyErode::Simulation simulation(w, h);
+  TinyErode::Uniform<float> uniformErosion(kErosion);
 
-    simulation.SetTimeStep(timeStep);
-    simulation.SetMetersPerX(xRange / w);
-    simulation.SetMetersPerY(yRange / h);
-    simulation.SetMinTilt(minTilt);
+  TinyErode::Uniform<float> uniformDeposition(kDeposition);
+
+  TinyErode::Uniform<float> uniformEvaporation(kEvaporation);
+
+  TinyErode::Simulation simulation(w, h);
+
+  simulation.SetTimeStep(timeStep);
+  simulation.SetMetersPerX(xRange / w);
+  simulation.SetMetersPerY(yRange / h);
+  simulation.SetMinTilt(minTilt);
+
+  for (int i = 0; i < rainfalls; i++) {
+
+    simulation.Reset();
 
     std::cout << "Simulating rainfall " << i << " of " << rainfalls
               << std::endl;
@@ -249,16 +297,27 @@ main(int argc, char** argv)
 
       auto start = std::chrono::high_resolution_clock::now();
 
-      simulation.ComputeFlowAndTilt(getHeight, getWater);
-
-      simulation.TransportWater(addWater);
-
-      simulation.TransportSediment(carryCapacity,
-                                   deposition,
-                                   erosion,
-                                   addHeight);
-
-      simulation.Evaporate(addWater, evaporation);
+      if (uniform) {
+        Iterate(simulation,
+                getHeight,
+                getWater,
+                addWater,
+                addHeight,
+                uniformCarryCapacity,
+                uniformDeposition,
+                uniformErosion,
+                uniformEvaporation);
+      } else {
+        Iterate(simulation,
+                getHeight,
+                getWater,
+                addWater,
+                addHeight,
+                carryCapacity,
+                deposition,
+                erosion,
+                evaporation);
+      }
 
       auto stop = std::chrono::high_resolution_clock::now();
 